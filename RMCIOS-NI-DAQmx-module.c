@@ -22,16 +22,262 @@ file, You can obtain one at http://mozilla.org/MPL/2.0/.
  * Changelog: (date,who,description)
  */
 
+/*
+ * Concurrency model:
+ * Channels may be called from several RMCIOS threads. Acquisition also 
+ * runs on NI-DAQmx callback threads (continuous nidev), device group 
+ * workers (nigroup) and the output watchdog thread.
+ * - Every driver task is owned by one channel with a recursive lock. All
+ *   driver calls and state changes of the channel are made holding it.
+ *   Analog inputs, their calibration, triggers and PID loops are protected
+ *   by the lock of their nidev.
+ * - Latest input values are read without locks. Scalars are stored atomically
+ *   and the value vector of nidev is published with a sequence counter.
+ * - Counter read and reset is one locked operation. Counts are not lost or
+ *   reported twice by concurrent callers.
+ * - Driver callbacks only try the device lock. Stopping a task or 
+ *   unregistering its events waits for running callbacks, so a callback
+ *   must not block on the lock held by the thread doing it.
+ * - Group workers live until module unload so closing a device never
+ *   waits for a worker that waits for the device lock.
+ * - Channel creation and device registration are expected from one 
+ *   configuration thread at a time.
+ */
+
 #define DLL
 
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#endif
 
 #include <NIDAQmx.h>
 
 #include "RMCIOS-functions.h"
+#include "RMCIOS-NI-DAQmx-shm.h"
+
+// Monotonic time in seconds for measuring module internal timing
+float64 ni_time (void)
+{
+#ifdef _WIN32
+   LARGE_INTEGER frequency, counter;
+   QueryPerformanceFrequency (&frequency);
+   QueryPerformanceCounter (&counter);
+   return (float64) counter.QuadPart / frequency.QuadPart;
+#else
+   struct timespec now;
+   clock_gettime (CLOCK_MONOTONIC, &now);
+   return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+// Sleep the calling thread
+void ni_sleep (float64 seconds)
+{
+#ifdef _WIN32
+   Sleep ((DWORD) (seconds * 1000));
+#else
+   struct timespec delay;
+   delay.tv_sec = (time_t) seconds;
+   delay.tv_nsec = (long) ((seconds - delay.tv_sec) * 1e9);
+   nanosleep (&delay, NULL);
+#endif
+}
+
+// Locks and threads
+#ifdef _WIN32
+typedef CRITICAL_SECTION ni_lock;
+#define ni_lock_init(lock) InitializeCriticalSection (lock)
+#define ni_lock_free(lock) DeleteCriticalSection (lock)
+#define ni_lock_take(lock) EnterCriticalSection (lock)
+#define ni_lock_give(lock) LeaveCriticalSection (lock)
+#define ni_lock_try(lock) (TryEnterCriticalSection (lock) != 0)
+
+typedef HANDLE ni_thread;
+#define NI_THREAD_FUNC(name, arg) DWORD WINAPI name (LPVOID arg)
+#define ni_thread_start(thread, func, arg) \
+   ((*(thread) = CreateThread (NULL, 0, func, arg, 0, NULL)) != NULL)
+#define ni_thread_join(thread) \
+   (WaitForSingleObject (thread, INFINITE), CloseHandle (thread))
+
+typedef HANDLE ni_sem;
+#define ni_sem_init(sem) \
+   (*(sem) = CreateSemaphore (NULL, 0, 0x7fffffff, NULL))
+#define ni_sem_free(sem) CloseHandle (*(sem))
+#define ni_sem_post(sem) ReleaseSemaphore (*(sem), 1, NULL)
+#define ni_sem_wait(sem) WaitForSingleObject (*(sem), INFINITE)
+#else
+typedef pthread_mutex_t ni_lock;
+#define ni_lock_init(lock) ni_lock_init_recursive (lock)
+#define ni_lock_free(lock) pthread_mutex_destroy (lock)
+#define ni_lock_take(lock) pthread_mutex_lock (lock)
+#define ni_lock_give(lock) pthread_mutex_unlock (lock)
+#define ni_lock_try(lock) (pthread_mutex_trylock (lock) == 0)
+
+typedef pthread_t ni_thread;
+#define NI_THREAD_FUNC(name, arg) void *name (void *arg)
+#define ni_thread_start(thread, func, arg) \
+   (pthread_create (thread, NULL, func, arg) == 0)
+#define ni_thread_join(thread) pthread_join (thread, NULL)
+
+typedef sem_t ni_sem;
+#define ni_sem_init(sem) sem_init (sem, 0, 0)
+#define ni_sem_free(sem) sem_destroy (sem)
+#define ni_sem_post(sem) sem_post (sem)
+#define ni_sem_wait(sem) sem_wait (sem)
+#endif
+
+#ifndef _WIN32
+// Same thread may lock again, as Win32 critical sections do
+void ni_lock_init_recursive (pthread_mutex_t *lock)
+{
+   pthread_mutexattr_t attr;
+   pthread_mutexattr_init (&attr);
+   pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init (lock, &attr);
+   pthread_mutexattr_destroy (&attr);
+}
+#endif
+
+// Take lock of channel data for one channel call. Returns the lock to give
+// at the end of the call, or NULL for calls of the class without data.
+ni_lock *ni_hold (ni_lock *lock)
+{
+   if (lock != NULL)
+      ni_lock_take (lock);
+   return lock;
+}
+
+// Atomic access to values read without locks
+void ni_store_f (float *dst, float value)
+{
+   __atomic_store (dst, &value, __ATOMIC_RELEASE);
+}
+
+float ni_load_f (float *src)
+{
+   float value;
+   __atomic_load (src, &value, __ATOMIC_ACQUIRE);
+   return value;
+}
+
+void ni_store_f64 (float64 *dst, float64 value)
+{
+   __atomic_store (dst, &value, __ATOMIC_RELEASE);
+}
+
+float64 ni_load_f64 (float64 *src)
+{
+   float64 value;
+   __atomic_load (src, &value, __ATOMIC_ACQUIRE);
+   return value;
+}
+
+// Sequence counter of data published to lock free readers. Single writer.
+// Counter is odd while the writer updates the data.
+void ni_seq_write_begin (uInt32 *seq)
+{
+   __atomic_store_n (seq, *seq + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+void ni_seq_write_end (uInt32 *seq)
+{
+   __atomic_store_n (seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+// Wait until no update is in progress. Returns counter for ni_seq_retry.
+uInt32 ni_seq_read_begin (uInt32 *seq)
+{
+   uInt32 value;
+   while ((value = __atomic_load_n (seq, __ATOMIC_ACQUIRE)) & 1);
+   return value;
+}
+
+// Returns 1 if data was updated during the read and must be read again
+int ni_seq_retry (uInt32 *seq, uInt32 value)
+{
+   __atomic_thread_fence (__ATOMIC_ACQUIRE);
+   return __atomic_load_n (seq, __ATOMIC_RELAXED) != value;
+}
+
+// Channel data allocated by the module. Released when module is unloaded.
+struct ni_resource
+{
+   void *data;
+   int id;                     // channel of data
+   void (*close) (void *data); // stops and clears driver resources of data
+   ni_lock *lock;              // lock in data, deleted on unload. NULL=none
+   struct ni_resource *next;
+} *first_ni_resource = NULL;
+
+// Register allocated channel data for release on module unload
+void ni_register_resource (void *data, int id, void (*close) (void *data),
+                           ni_lock *lock)
+{
+   struct ni_resource *resource;
+   resource = (struct ni_resource *) malloc (sizeof (struct ni_resource));
+   if (resource == NULL)
+      return;
+   resource->data = data;
+   resource->id = id;
+   resource->close = close;
+   resource->lock = lock;
+   resource->next = first_ni_resource;
+   first_ni_resource = resource;
+}
+
+// Find data of channel. Class is identified by its close function.
+void *ni_find_resource (int id, void (*close) (void *data))
+{
+   struct ni_resource *resource = first_ni_resource;
+   while (resource != NULL)
+   {
+      if (resource->id == id && resource->close == close)
+         return resource->data;
+      resource = resource->next;
+   }
+   return NULL;
+}
+
+// Return 64-bit counter exactly as decimal string
+void ni_return_u64 (const struct context_rmcios *context,
+                    struct combo_rmcios *returnv, uInt64 value)
+{
+   char str[24];
+   snprintf (str, sizeof (str), "%" PRIu64, (uint64_t) value);
+   return_string (context, returnv, str);
+}
+
+// Test if the first parameter is given command keyword
+int ni_is_command (const struct context_rmcios *context,
+                   enum type_rmcios paramtype, const union param_rmcios param,
+                   int num_params, const char *command)
+{
+   char cmd_str[20];
+   if (num_params < 1)
+      return 0;
+   param_to_string (context, paramtype, param, 0, sizeof (cmd_str), cmd_str);
+   return strcmp (cmd_str, command) == 0;
+}
+
+// Stop and clear driver task
+void ni_clear_task (TaskHandle *task)
+{
+   if (*task == 0)
+      return;
+   DAQmxStopTask (*task);
+   DAQmxClearTask (*task);
+   *task = 0;
+}
 
 ///////////////////////////////////////////////////
 // Analog input
@@ -41,399 +287,2789 @@ file, You can obtain one at http://mozilla.org/MPL/2.0/.
                                     DAQmxGetExtendedErrorInfo(errBuff,2048) ; \
                                     printf("%s\r\n",errBuff) ;}
 
-struct ni_device_data
-{
-   int channel_id;
-   char name[20];
-   TaskHandle task;
-   int channels;
-   int samples;
-   float64 rate;
-   float values[100];
+// Blocks buffered by the driver in continuous acquisition
+#define NI_BUFFER_BLOCKS 10
 
-   // linked list of ni devices in the system
-   struct ni_device_data *next_device;  
-} *first_ni_device = NULL; // pointer to first ni device in the system.
+// Handling of blocks that piled up when processing is slower than the
+// acquisition
+#define NI_OVERRUN_STALL       0  // process every block, fall behind
+#define NI_OVERRUN_DROP_OLDEST 1  // process newest block only
+#define NI_OVERRUN_DROP_NEWEST 2  // process oldest block only
+#define NI_OVERRUN_COALESCE    3  // reduce all pending blocks as one block
+// Maximum number of analog input channels on one device
+#define NI_MAX_CHANNELS 100
 
-// Helper function to find ni_device data for given NI device channel id.
-struct ni_device_data *get_ni_device_for_channel (int channel_id)
+// Nonlinear conversion from volts to engineering units. 
+// Applied on every sample of the block before averaging.
+#define NI_SCALE_POLY  1   // c[0] + c[1]*x + c[2]*x^2 ... 
+#define NI_SCALE_TABLE 2   // piecewise linear lookup from x[] to c[]
+#define NI_SCALE_POINTS 16
+
+struct ni_scale
 {
-   // Find the specified device:
-   struct ni_device_data *device = first_ni_device;
-   while (device != NULL)
+   int type;
+   int n;                        // number of coefficients or table points
+   float64 c[NI_SCALE_POINTS];   // coefficients or table output values
+   float64 x[NI_SCALE_POINTS];   // table input values in ascending order
+};
+
+// Convert block of samples in place
+void ni_scale_block (const struct ni_scale *scale, float64 *data, int samples)
+{
+   int i, k;
+   const float64 *c = scale->c;
+   const float64 *x = scale->x;
+
+   if (scale->type == NI_SCALE_POLY)
    {
-      if (device->channel_id == channel_id)
-         return device;
-      device = device->next_device;
+      // Horner evaluation, independent for every sample
+      for (i = 0; i < samples; i++)
+      {
+         float64 v = data[i];
+         float64 y = c[scale->n - 1];
+         for (k = scale->n - 2; k >= 0; k--)
+            y = y * v + c[k];
+         data[i] = y;
+      }
+   }
+   else if (scale->type == NI_SCALE_TABLE && scale->n >= 2)
+   {
+      // Consecutive samples are close, continue search from previous segment
+      k = 0;
+      for (i = 0; i < samples; i++)
+      {
+         float64 v = data[i];
+         while (k > 0 && v < x[k])
+            k--;
+         while (k < scale->n - 2 && v >= x[k + 1])
+            k++;
+         // Linear interpolation, end segments extrapolate
+         data[i] = c[k] + (v - x[k]) * (c[k + 1] - c[k]) / (x[k + 1] - x[k]);
+      }
    }
 }
 
-void ni_device_func (struct ni_device_data *this,
-                     const struct context_rmcios *context, int id,
-                     enum function_rmcios function,
-                     enum type_rmcios paramtype,
-                     struct combo_rmcios *returnv,
-                     int num_params, const union param_rmcios param)
+// Snapshot capture around a trigger condition on analog input samples
+#define NI_TRIG_LEVEL   1  // sample above level
+#define NI_TRIG_RISING  2  // samples cross level upwards
+#define NI_TRIG_FALLING 3  // samples cross level downwards
+#define NI_TRIG_WINDOW  4  // sample outside of window low..high
+
+struct ni_trigger
 {
-   int i;
-   switch (function)
+   int type;
+   float64 low;         // trigger level or window low limit
+   float64 high;        // window high limit
+   int pre;             // samples before trigger in snapshot
+   int post;            // samples from trigger on in snapshot
+   float64 last;        // last sample of previous block for edge detection
+   int has_last;  
+
+   // Ring buffer of latest samples before the trigger
+   float64 *ring;
+   int ring_pos;        // next write position
+   int ring_fill;       // number of valid samples
+
+   float *snapshot;     // captured pre and post trigger samples
+   int snapshot_pre;    // pre trigger samples in snapshot
+   int captured;        // post trigger samples captured. -1=armed
+};
+
+// Allocate trigger with pre and post trigger sample buffers
+struct ni_trigger *ni_trigger_new (int type, float64 low, float64 high,
+                                   int pre, int post)
+{
+   struct ni_trigger *trigger;
+   if (pre < 0)
+      pre = 0;
+   if (post < 1)
+      post = 1;
+   trigger = (struct ni_trigger *) malloc (sizeof (struct ni_trigger));
+   if (trigger == NULL)
+      return NULL;
+   trigger->type = type;
+   trigger->low = low;
+   trigger->high = high;
+   trigger->pre = pre;
+   trigger->post = post;
+   trigger->has_last = 0;
+   trigger->ring_pos = 0;
+   trigger->ring_fill = 0;
+   trigger->snapshot_pre = 0;
+   trigger->captured = -1;
+   trigger->ring = (float64 *) malloc (sizeof (float64) * (pre + 1));
+   trigger->snapshot = (float *) malloc (sizeof (float) * (pre + post));
+   if (trigger->ring == NULL || trigger->snapshot == NULL)
    {
-   case help_rmcios:
-      return_string (context, returnv,
-                     "help for niai device. Commands:\r\n"
-                     "create nidev newname \r\n"
-                     "setup newname device_name | sample_rate | samples \r\n"
-                     "write newname do one measurement\r\n");
+      free (trigger->ring);
+      free (trigger->snapshot);
+      free (trigger);
+      return NULL;
+   }
+   return trigger;
+}
 
-   case create_rmcios:
-      if (num_params < 1)
-         break;
+void ni_trigger_free (struct ni_trigger *trigger)
+{
+   if (trigger == NULL)
+      return;
+   free (trigger->ring);
+   free (trigger->snapshot);
+   free (trigger);
+}
 
-      // allocate new data
-      this = (struct ni_device_data *) malloc (sizeof (struct ni_device_data)); 
-      if (this == NULL) break;
-      
-      // create channel     
-      this->channel_id = create_channel_param (context, paramtype, param, 0, 
-                                               (class_rmcios) ni_device_func, 
-                                               this); 
+// Find first sample from index from on that meets the trigger condition.
+// Returns -1 if none. Blocks that can not contain a trigger are rejected
+// on their range.
+int ni_trigger_scan (struct ni_trigger *trigger, const float64 *data, 
+                     int from, int samples)
+{
+   int i;
+   float64 min = data[from], max = data[from];
+   int has_prev = from > 0 || trigger->has_last;
+   float64 prev = from > 0 ? data[from - 1] : trigger->last;
 
-      //default values:
-      this->name[0] = 0;
-      this->task = 0;
-      this->channels = 0;
-      this->samples = 1;
-      this->rate = 10;
-      this->next_device = NULL;
+   for (i = from + 1; i < samples; i++)
+   {
+      min = data[i] < min ? data[i] : min;
+      max = data[i] > max ? data[i] : max;
+   }
+   if (has_prev)
+   {
+      min = prev < min ? prev : min;
+      max = prev > max ? prev : max;
+   }
+   if (!has_prev)
+      prev = data[from];
 
-      //add device to list of NIDAQ devices:
-      if (first_ni_device == NULL)
-      {
-         // this is the first device in the system
-         first_ni_device = this;  
-      }
-      else
+   switch (trigger->type)
+   {
+   case NI_TRIG_LEVEL:
+      if (max <= trigger->low)
+         return -1;
+      for (i = from; i < samples; i++)
+         if (data[i] > trigger->low)
+            return i;
+      break;
+
+   case NI_TRIG_RISING:
+   case NI_TRIG_FALLING:
+      if (max < trigger->low || min >= trigger->low)
+         return -1;
+      for (i = from; i < samples; i++)
       {
-         // find the last device
-         struct ni_device_data *devices = first_ni_device;
-         while (devices->next_device != NULL)
-            devices = devices->next_device;     
-         
-         // Add this device to the list
-         devices->next_device = this;   
+         if (trigger->type == NI_TRIG_RISING 
+             && prev < trigger->low && data[i] >= trigger->low)
+            return i;
+         if (trigger->type == NI_TRIG_FALLING 
+             && prev >= trigger->low && data[i] < trigger->low)
+            return i;
+         prev = data[i];
       }
-
-      // Create the device task
-      DAQmxErrChk (DAQmxCreateTask ("", //const char taskName[], 
-                                    &this->task)); //TaskHandle *taskHandle);
       break;
 
-   case setup_rmcios:
-      if (this == NULL)
-         break;
-      if (num_params < 1)
-         break;
-      
-      // device name
-      param_to_string (context, paramtype, param, 0, 
-                       sizeof (this->name), this->name);  
-      
-      if (num_params >= 3)
-         // 3.samples
-         this->samples = param_to_int (context, paramtype, param, 2); 
-      if (num_params >= 2)
-         // 2.sample_rate
-         this->rate = param_to_int (context, paramtype, param, 1);      
+   case NI_TRIG_WINDOW:
+      if (min >= trigger->low && max <= trigger->high)
+         return -1;
+      for (i = from; i < samples; i++)
+         if (data[i] < trigger->low || data[i] > trigger->high)
+            return i;
       break;
+   }
+   return -1;
+}
 
-   case write_rmcios:
-      if (this == NULL)
-         break;
+// Run trigger on block of samples from *offset on. Returns 1 when a 
+// snapshot is complete and sets *offset after its last sample. Call again
+// until 0 is returned to find all snapshots of the block.
+int ni_trigger_block (struct ni_trigger *trigger, const float64 *data, 
+                      int samples, int *offset)
+{
+   int start = *offset;
+   int i, n;
+
+   if (start < samples && trigger->captured < 0)
+   {
+      // Armed: look for the trigger
+      start = ni_trigger_scan (trigger, data, start, samples);
+      if (start < 0)
+         start = samples;
+      else
       {
-         int32 read = 0;
-         int ch;
-         int i;
-         float64 buffer[this->samples * this->channels];
-         float values[this->channels];
+         // Pre trigger samples from ring buffer history and this block
+         int from_block = start < trigger->pre ? start : trigger->pre;
+         int from_ring = trigger->pre - from_block;
+         if (from_ring > trigger->ring_fill)
+            from_ring = trigger->ring_fill;
 
-         if (this->task != 0)
+         n = 0;
+         for (i = from_ring; i > 0; i--)
          {
-            DAQmxStopTask (this->task);
+            int pos = (trigger->ring_pos - i + trigger->pre) % trigger->pre;
+            trigger->snapshot[n++] = trigger->ring[pos];
          }
-         // Create the device task
-         DAQmxErrChk (DAQmxStartTask (this->task));
+         for (i = start - from_block; i < start; i++)
+            trigger->snapshot[n++] = data[i];
+         trigger->snapshot_pre = n;
+         trigger->captured = 0;
+      }
+   }
 
-         // (TaskHandle taskHandle, 
-         DAQmxErrChk (
-            DAQmxReadAnalogF64 (this->task,   
-                                DAQmx_Val_Auto, // int32 numSampsPerChan, 
-                                10,   // float64 timeout, 
-                                DAQmx_Val_GroupByChannel, // bool32 fillMode
-                                buffer,       // float64 readArray[],
-                                this->samples * this->channels, 
-                                &read,        // int32 *sampsPerChanRead,
-                                NULL));       // bool32 *reserved);
+   if (start < samples && trigger->captured >= 0)
+   {
+      // Capturing: collect post trigger samples
+      n = trigger->post - trigger->captured;
+      if (n > samples - start)
+         n = samples - start;
+      float *dst = trigger->snapshot + trigger->snapshot_pre 
+                   + trigger->captured;
+      for (i = 0; i < n; i++)
+         dst[i] = data[start + i];
+      trigger->captured += n;
+      if (trigger->captured == trigger->post)
+      {
+         // Re-armed. Rest of the block is scanned on the next call.
+         trigger->captured = -1;
+         *offset = start + n;
+         return 1;
+      }
+   }
+   *offset = samples;
+   if (samples < 1)
+      return 0;
 
-         if (read != this->samples)
-         {
-            printf ("ERROR DAQMX wrong ammount of samples read: %d\r\n", read);
-         }
-         else
-         {
-            for (ch = 0; ch < this->channels; ch++) // average loop
-            {
-               this->values[ch] = 0;
-               float64 *ch_data = buffer + ch * this->samples;
+   // Keep latest samples in the ring buffer for the next trigger
+   if (trigger->pre > 0)
+   {
+      i = samples > trigger->pre ? samples - trigger->pre : 0;
+      for (; i < samples; i++)
+      {
+         trigger->ring[trigger->ring_pos] = data[i];
+         trigger->ring_pos = (trigger->ring_pos + 1) % trigger->pre;
+      }
+      trigger->ring_fill += samples;
+      if (trigger->ring_fill > trigger->pre)
+         trigger->ring_fill = trigger->pre;
+   }
+   trigger->last = data[samples - 1];
+   trigger->has_last = 1;
+   return 0;
+}
 
-               for (i = 0; i < this->samples; i++)
-               {
-                  this->values[ch] += ch_data[i];
+// Function run inside the device acquisition on every block of an analog 
+// input. Receives the calibrated block mean and samples.
+struct ni_block_hook
+{
+   void (*func) (void *data, const struct context_rmcios *context,
+                 float64 value, const float64 *samples, int n, float64 rate);
+   void *data;
+   struct ni_block_hook *next;
+};
 
-               }
-               this->values[ch] /= this->samples;
-            }
-            //int channel,
-            run_channel (context, linked_channels (context, id), 
-                                  write_rmcios, 
-                                  float_rmcios, 
-                                  0, 
-                                  this->channels,       
-                                  (const union param_rmcios)this->values); 
-         }
-      }
-      break;
+void ni_hook_add (struct ni_block_hook **hooks, 
+                  void (*func) (void *data, 
+                                const struct context_rmcios *context,
+                                float64 value, const float64 *samples, 
+                                int n, float64 rate), 
+                  void *data)
+{
+   struct ni_block_hook *hook;
+   hook = (struct ni_block_hook *) malloc (sizeof (struct ni_block_hook));
+   if (hook == NULL)
+      return;
+   hook->func = func;
+   hook->data = data;
+   hook->next = *hooks;
+   *hooks = hook;
+}
 
-   case read_rmcios:
-      if (this == NULL)
-         break;
+void ni_hook_remove (struct ni_block_hook **hooks, void *data)
+{
+   while (*hooks != NULL)
+   {
+      if ((*hooks)->data == data)
       {
-         int i;
-         for (i = 0; i < this->channels; i++)
-         {
-            return_float (context, returnv, this->values[i]);
-            return_string (context, returnv, " ");
-         }
+         struct ni_block_hook *hook = *hooks;
+         *hooks = hook->next;
+         free (hook);
       }
-      break;
+      else
+         hooks = &(*hooks)->next;
    }
 }
 
+// Analog input channel. Receives its value from a slot of a NI device.
 struct niai_data
 {
    int id;
    int channel_index;
    float value;
+   struct ni_device_data *device;
+   struct ni_trigger *trigger;  // NULL=value of every block to linked
+   struct ni_block_hook *hooks; // in module consumers of the blocks
+   char name[64];               // channel name for bulk configuration
+   char terminal[30];           // physical channel on the device
+   int term_cfg;                // terminal configuration
+   float64 min_val, max_val;    // input range
 };
 
-void nidaq_ai_func (struct niai_data *this,
-                    const struct context_rmcios *context, int id,
-                    enum function_rmcios function,
-                    enum type_rmcios paramtype,
-                    struct combo_rmcios *returnv,
-                    int num_params, const union param_rmcios param)
+struct ni_device_data
+{
+   int channel_id;
+   char name[20];
+   TaskHandle task;
+   int channels;
+   int samples;
+   float64 rate;              // sample clock rate coerced by the hardware
+   float64 requested_rate;    // sample clock rate requested in setup
+   float64 line_frequency;    // mains frequency for line synchronous blocks
+   int line_cycles;           // mains cycles per block. 0=free running 
+   int continuous;            // 1=blocks pushed by driver sample events
+   int event_samples;         // registered every N samples event. 0=none
+   const struct context_rmcios *context; // context for driver callbacks
+   ni_lock lock;              // serializes task and acquisition state
+   uInt32 values_seq;         // odd while values are being updated
+   float values[NI_MAX_CHANNELS];
+
+   // Per channel calibration. Linear part is applied on the block means,
+   // nonlinear part on every sample. 
+   float64 gain[NI_MAX_CHANNELS];
+   float64 offset[NI_MAX_CHANNELS];
+   struct ni_scale *scales[NI_MAX_CHANNELS]; // NULL=no nonlinear scale
+
+   // Dispatch table from channel slot to niai channel. NULL=unused slot
+   struct niai_data *slots[NI_MAX_CHANNELS];
+   uInt64 blocks;             // number of processed blocks
+   float64 dispatch_time;     // time spent sending last block to channels
+
+   // Sample buffer for up to NI_BUFFER_BLOCKS blocks of all channels
+   float64 *buffer;
+   int buffer_samples;        // samples per channel that fit in buffer
+
+   // Overrun accounting
+   int overrun_policy;        // NI_OVERRUN_*
+   uInt64 overruns;           // driver buffer overflows. Samples lost.
+   uInt64 underflows;         // reads that returned too few samples
+   uInt64 dropped;            // blocks discarded by overrun policy
+   uInt64 coalesced;          // blocks merged into other blocks
+   uInt32 max_backlog;        // most samples per channel waiting in driver
+   uInt64 shm_dropped;        // blocks not fitting the shared memory layout
+
+   struct ni_worker *worker;  // reads for device groups. NULL=not started
+
+   // Shared memory export of blocks. header NULL=not exported
+   struct ni_shm_map shm;
+   char shm_name[64];
+
+   // linked list of ni devices in the system
+   struct ni_device_data *next_device;  
+} *first_ni_device = NULL; // pointer to first ni device in the system.
+
+// Helper function to find ni_device data for given NI device channel id.
+struct ni_device_data *get_ni_device_for_channel (int channel_id)
+{
+   // Find the specified device:
+   struct ni_device_data *device = first_ni_device;
+   while (device != NULL)
+   {
+      if (device->channel_id == channel_id)
+         return device;
+      device = device->next_device;
+   }
+   return NULL;
+}
+
+// Stop shared memory export
+void ni_device_shm_close (struct ni_device_data *this)
+{
+   if (this->shm.header == NULL)
+      return;
+   // Readers still mapping the old ring see it closed
+   __atomic_store_n (&this->shm.header->magic, 0, __ATOMIC_RELEASE);
+   ni_shm_close (&this->shm);
+   ni_shm_unlink (this->shm_name);
+}
+
+// Start shared memory export of blocks with current channels and samples
+void ni_device_shm_open (struct ni_device_data *this, const char *name, 
+                         int slots)
+{
+   struct ni_shm_header *header;
+   size_t slot_size = ni_shm_slot_size (this->channels, this->samples);
+
+   ni_device_shm_close (this);
+   if (slots < 2)
+      slots = 2;
+   strncpy (this->shm_name, name, sizeof (this->shm_name) - 1);
+   this->shm_name[sizeof (this->shm_name) - 1] = 0;
+   if (ni_shm_open (&this->shm, this->shm_name, 
+                    sizeof (struct ni_shm_header) + slots * slot_size) != 0)
+   {
+      printf ("Could not create shared memory: %s\r\n", this->shm_name);
+      return;
+   }
+
+   header = this->shm.header;
+   memset (header, 0, sizeof (struct ni_shm_header) + slots * slot_size);
+   header->version = NI_SHM_VERSION;
+   header->slots = slots;
+   header->channels = this->channels;
+   header->samples = this->samples;
+   header->slot_size = slot_size;
+   __atomic_store_n (&header->magic, NI_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Publish calibrated block and channel statistics to shared memory ring
+void ni_device_shm_publish (struct ni_device_data *this, 
+                            const float64 *buffer, int samples)
+{
+   struct ni_shm_header *header = this->shm.header;
+   struct ni_shm_slot *slot;
+   uint64_t head;
+   uint32_t seq;
+   int ch, i;
+
+   int kept = samples;
+
+   // Ring is recreated when timing is configured with a new layout
+   if ((uint32_t) this->channels > header->channels)
+   {
+      this->shm_dropped++;
+      return;
+   }
+   // Coalesced blocks keep their latest samples. Statistics cover all.
+   if ((uint32_t) kept > header->samples)
+      kept = header->samples;
+
+   head = header->head;
+   slot = ni_shm_get_slot (header, head);
+
+   // Odd sequence marks the slot as being written
+   seq = slot->seq;
+   __atomic_store_n (&slot->seq, seq + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence (__ATOMIC_RELEASE);
+
+   slot->channels = this->channels;
+   slot->samples = kept;
+   slot->block_samples = samples;
+   slot->block = this->blocks;
+   slot->rate = this->rate;
+   slot->time = ni_time ();
+
+   double *mean = ni_shm_slot_mean (header, slot);
+   double *min = ni_shm_slot_min (header, slot);
+   double *max = ni_shm_slot_max (header, slot);
+   double *data = ni_shm_slot_data (header, slot);
+   for (ch = 0; ch < this->channels; ch++)
+   {
+      const float64 *ch_data = buffer + ch * samples;
+      double *dst = data + ch * kept;
+      double lo = ch_data[0], hi = ch_data[0];
+      for (i = 0; i < samples; i++)
+      {
+         lo = ch_data[i] < lo ? ch_data[i] : lo;
+         hi = ch_data[i] > hi ? ch_data[i] : hi;
+      }
+      memcpy (dst, ch_data + samples - kept, sizeof (double) * kept);
+      mean[ch] = this->values[ch];
+      min[ch] = lo;
+      max[ch] = hi;
+   }
+
+   __atomic_store_n (&slot->seq, seq + 2, __ATOMIC_RELEASE);
+   __atomic_store_n (&header->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Add device to list of NIDAQ devices
+void ni_device_register (struct ni_device_data *this)
+{
+   struct ni_device_data *devices = first_ni_device;
+   if (first_ni_device == NULL)
+   {
+      // this is the first device in the system
+      first_ni_device = this;  
+      return;
+   }
+
+   // find the last device
+   while (devices != this && devices->next_device != NULL)
+      devices = devices->next_device;     
+   
+   // Add this device to the list
+   if (devices != this)
+      devices->next_device = this;   
+}
+
+// Remove device from list of NIDAQ devices
+void ni_device_unregister (struct ni_device_data *this)
+{
+   struct ni_device_data **link = &first_ni_device;
+   while (*link != NULL)
+   {
+      if (*link == this)
+      {
+         *link = this->next_device;
+         break;
+      }
+      link = &(*link)->next_device;
+   }
+   this->next_device = NULL;
+}
+
+// Read samples per channel from device task into the device buffer.
+// Returns number of samples per channel read. Accounts overruns and short
+// reads. 
+int ni_device_read (struct ni_device_data *this, int samples)
+{
+   int32 read = 0;
+   int32 error;
+
+   if (this->buffer == NULL || samples > this->buffer_samples)
+      return 0;
+
+   // (TaskHandle taskHandle, 
+   error = DAQmxReadAnalogF64 (this->task,   
+                               samples,   // int32 numSampsPerChan, 
+                               10,        // float64 timeout, 
+                               DAQmx_Val_GroupByChannel, // bool32 fillMode
+                               this->buffer,  // float64 readArray[],
+                               samples * this->channels, 
+                               &read,     // int32 *sampsPerChanRead,
+                               NULL);     // bool32 *reserved);
+
+   if (error == DAQmxErrorSamplesNoLongerAvailable)
+   {
+      // Driver buffer overwritten before read. Restart acquisition.
+      this->overruns++;
+      DAQmxStopTask (this->task);
+      DAQmxErrChk (DAQmxStartTask (this->task));
+      return 0;
+   }
+   DAQmxErrChk (error);
+
+   if (read != samples)
+   {
+      this->underflows++;
+      printf ("ERROR DAQMX wrong ammount of samples read: %d\r\n", read);
+      return 0;
+   }
+   return read;
+}
+
+// Average block of n samples per channel and send the channel averages to 
+// linked channels. Samples in data are grouped by channel and calibrated 
+// in place.
+void ni_device_process (struct ni_device_data *this,
+                        const struct context_rmcios *context, 
+                        float64 *data, int n)
+{
+   int ch;
+   int i;
+   float64 sums[this->channels];
+
+   for (ch = 0; ch < this->channels; ch++) // average loop
+   {
+      float64 sum = 0;
+      float64 *ch_data = data + ch * n;
+
+      if (this->scales[ch] != NULL)
+         ni_scale_block (this->scales[ch], ch_data, n);
+
+      for (i = 0; i < n; i++)
+      {
+         sum += ch_data[i];
+      }
+      sums[ch] = sum;
+   }
+
+   // Means and linear calibration of all channels in one pass
+   ni_seq_write_begin (&this->values_seq);
+   for (ch = 0; ch < this->channels; ch++) 
+   {
+      this->values[ch] = sums[ch] / n * this->gain[ch] 
+                         + this->offset[ch];
+   }
+   ni_seq_write_end (&this->values_seq);
+   this->blocks++;
+
+   // Calibrated samples for in module consumers and shared memory
+   for (ch = 0; ch < this->channels; ch++) 
+   {
+      struct niai_data *slot = this->slots[ch];
+      float64 *ch_data = data + ch * n;
+      if (this->shm.header == NULL && (slot == NULL 
+          || (slot->trigger == NULL && slot->hooks == NULL)))
+         continue;
+      if (this->gain[ch] != 1 || this->offset[ch] != 0)
+      {
+         for (i = 0; i < n; i++)
+            ch_data[i] = ch_data[i] * this->gain[ch] + this->offset[ch];
+      }
+   }
+
+   if (this->shm.header != NULL)
+      ni_device_shm_publish (this, data, n);
+
+   // Hand the values directly to niai channels of the slots
+   float64 dispatch_start = ni_time ();
+   for (ch = 0; ch < this->channels; ch++) 
+   {
+      struct niai_data *slot = this->slots[ch];
+      if (slot == NULL)
+         continue;
+      ni_store_f (&slot->value, this->values[ch]);
+      if (slot->trigger == NULL && slot->hooks == NULL)
+      {
+         write_f (context, linked_channels (context, slot->id), slot->value);
+         continue;
+      }
+
+      float64 *ch_data = data + ch * n;
+      struct ni_block_hook *hook;
+      for (hook = slot->hooks; hook != NULL; hook = hook->next)
+      {
+         hook->func (hook->data, context, this->values[ch], 
+                     ch_data, n, this->rate);
+      }
+
+      // Triggered channel sends only captured snapshots
+      if (slot->trigger == NULL)
+      {
+         write_f (context, linked_channels (context, slot->id), slot->value);
+      }
+      else
+      {
+         int offset = 0;
+         while (ni_trigger_block (slot->trigger, ch_data, n, &offset))
+         {
+            run_channel (context, linked_channels (context, slot->id), 
+                         write_rmcios, float_rmcios, 0, 
+                         slot->trigger->snapshot_pre + slot->trigger->post,
+                         (const union param_rmcios) slot->trigger->snapshot);
+         }
+      }
+   }
+
+   // All values to channels linked to the device
+   run_channel (context, linked_channels (context, this->channel_id), 
+                         write_rmcios, 
+                         float_rmcios, 
+                         0, 
+                         this->channels,       
+                         (const union param_rmcios)this->values); 
+   this->dispatch_time = ni_time () - dispatch_start;
+}
+
+// Read pending blocks from the device and process them according to the
+// overrun policy. Finite acquisitions always have one block.
+void ni_device_acquire (struct ni_device_data *this,
+                        const struct context_rmcios *context)
+{
+   uInt32 available = 0;
+   int pending = 1;
+   int n;
+
+   if (this->continuous)
+   {
+      DAQmxGetReadAvailSampPerChan (this->task, &available);
+      if (available > this->max_backlog)
+         this->max_backlog = available;
+      pending = available / this->samples;
+      if (pending < 1)
+         pending = 1;
+      if (pending > NI_BUFFER_BLOCKS)
+         pending = NI_BUFFER_BLOCKS;
+   }
+
+   switch (this->overrun_policy)
+   {
+   case NI_OVERRUN_DROP_OLDEST:
+      // Discard all but the newest block
+      for (; pending > 1; pending--)
+      {
+         if (ni_device_read (this, this->samples) > 0)
+            this->dropped++;
+      }
+      n = ni_device_read (this, this->samples);
+      if (n > 0)
+         ni_device_process (this, context, this->buffer, n);
+      break;
+
+   case NI_OVERRUN_DROP_NEWEST:
+      // Process the oldest block and discard the rest
+      n = ni_device_read (this, this->samples);
+      if (n > 0)
+         ni_device_process (this, context, this->buffer, n);
+      for (; pending > 1; pending--)
+      {
+         if (ni_device_read (this, this->samples) > 0)
+            this->dropped++;
+      }
+      break;
+
+   case NI_OVERRUN_COALESCE:
+      // All pending blocks reduced as one
+      n = ni_device_read (this, pending * this->samples);
+      if (n > 0)
+      {
+         this->coalesced += pending - 1;
+         ni_device_process (this, context, this->buffer, n);
+      }
+      break;
+
+   default:
+      // Stall: process every pending block in order
+      for (; pending > 0; pending--)
+      {
+         n = ni_device_read (this, this->samples);
+         if (n <= 0)
+            break;
+         ni_device_process (this, context, this->buffer, n);
+      }
+      break;
+   }
+}
+
+// Thread that runs finite reads of one device for device groups
+struct ni_worker
+{
+   ni_thread thread;
+   ni_sem start;                // posted to start a read
+   ni_sem done;                 // posted when the read is finished
+   volatile int running;
+   struct ni_device_data *device;
+   int result;                  // samples per channel read
+   int channels;                // channels of the read block
+   float64 *block;              // copy of the read block for processing
+   int block_size;              // allocated values in block
+   float64 read_time;           // duration of last read
+};
+
+NI_THREAD_FUNC (ni_worker_func, arg)
+{
+   struct ni_worker *worker = (struct ni_worker *) arg;
+   struct ni_device_data *device = worker->device;
+   for (;;)
+   {
+      ni_sem_wait (&worker->start);
+      if (!worker->running)
+         break;
+
+      float64 start = ni_time ();
+      ni_lock_take (&device->lock);
+      worker->result = 0;
+      if (device->task != 0)
+      {
+         DAQmxStopTask (device->task);
+         DAQmxErrChk (DAQmxStartTask (device->task));
+         worker->result = ni_device_read (device, device->samples);
+      }
+
+      // Block is copied out so device reads from other threads before 
+      // the group processes it can not overwrite it.
+      worker->channels = device->channels;
+      if (worker->result > 0 
+          && worker->result * worker->channels > worker->block_size)
+      {
+         free (worker->block);
+         worker->block_size = worker->result * worker->channels;
+         worker->block = (float64 *) malloc (sizeof (float64) 
+                                             * worker->block_size);
+         if (worker->block == NULL)
+            worker->block_size = 0;
+      }
+      if (worker->block == NULL)
+         worker->result = 0;
+      if (worker->result > 0)
+         memcpy (worker->block, device->buffer, sizeof (float64) 
+                 * worker->result * worker->channels);
+      ni_lock_give (&device->lock);
+      worker->read_time = ni_time () - start;
+      ni_sem_post (&worker->done);
+   }
+   return 0;
+}
+
+// Start finite read of device on its worker thread
+void ni_worker_start (struct ni_device_data *this)
+{
+   struct ni_worker *worker = this->worker;
+   if (worker == NULL)
+   {
+      worker = (struct ni_worker *) malloc (sizeof (struct ni_worker));
+      if (worker == NULL)
+         return;
+      worker->device = this;
+      worker->running = 1;
+      worker->result = 0;
+      worker->channels = 0;
+      worker->block = NULL;
+      worker->block_size = 0;
+      worker->read_time = 0;
+      ni_sem_init (&worker->start);
+      ni_sem_init (&worker->done);
+      if (!ni_thread_start (&worker->thread, ni_worker_func, worker))
+      {
+         ni_sem_free (&worker->start);
+         ni_sem_free (&worker->done);
+         free (worker);
+         return;
+      }
+      this->worker = worker;
+   }
+   ni_sem_post (&worker->start);
+}
+
+// Wait for read started with ni_worker_start. Returns samples read.
+int ni_worker_join (struct ni_device_data *this)
+{
+   if (this->worker == NULL)
+      return 0;
+   ni_sem_wait (&this->worker->done);
+   return this->worker->result;
+}
+
+void ni_worker_stop (struct ni_device_data *this)
+{
+   struct ni_worker *worker = this->worker;
+   if (worker == NULL)
+      return;
+   worker->running = 0;
+   ni_sem_post (&worker->start);
+   ni_thread_join (worker->thread);
+   ni_sem_free (&worker->start);
+   ni_sem_free (&worker->done);
+   free (worker->block);
+   free (worker);
+   this->worker = NULL;
+}
+
+// Release driver task, calibration and channel slots of device.
+// The worker thread is kept until module unload. It may be waiting for
+// the device lock held by the caller.
+void ni_device_close (void *data)
+{
+   struct ni_device_data *this = (struct ni_device_data *) data;
+   int ch;
+
+   // Clearing the task also unregisters its sample events
+   ni_clear_task (&this->task);
+   this->event_samples = 0;
+   ni_device_unregister (this);
+   ni_device_shm_close (this);
+   free (this->buffer);
+   this->buffer = NULL;
+   this->buffer_samples = 0;
+
+   for (ch = 0; ch < NI_MAX_CHANNELS; ch++)
+   {
+      if (this->slots[ch] != NULL)
+         this->slots[ch]->device = NULL;
+      this->slots[ch] = NULL;
+      free (this->scales[ch]);
+      this->scales[ch] = NULL;
+      this->gain[ch] = 1;
+      this->offset[ch] = 0;
+   }
+   this->channels = 0;
+}
+
+// Driver callback for continuous acquisition. Called by NI-DAQmx each time
+// a full block has been acquired into the task buffer.
+int32 ni_device_block_ready (TaskHandle task, int32 event_type,
+                             uInt32 n_samples, void *callback_data)
+{
+   struct ni_device_data *this = (struct ni_device_data *) callback_data;
+
+   // Setup may hold the lock while stopping the task or unregistering this
+   // event, which waits for the running callback. Blocks left in the driver
+   // buffer are handled by the next event.
+   if (!ni_lock_try (&this->lock))
+      return 0;
+   ni_device_acquire (this, this->context);
+   ni_lock_give (&this->lock);
+   return 0;
+}
+
+// Commit sample clock timing of the device task. In line synchronous mode 
+// rate and block length are chosen so that one block integrates exactly 
+// line_cycles mains periods. The rate coerced by the hardware is read back
+// and the block length corrected to it.
+void ni_device_cfg_timing (struct ni_device_data *this)
+{
+   float64 rate = this->requested_rate;
+   float64 period = 0;
+   int samples;
+   int32 sample_mode = DAQmx_Val_FiniteSamps;
+   uInt64 buffer_samples;
+
+   if (this->line_cycles > 0)
+   {
+      period = this->line_cycles / this->line_frequency;
+      this->samples = (int) (this->requested_rate * period + 0.5);
+      if (this->samples < 1)
+         this->samples = 1;
+      rate = this->samples / period;
+   }
+
+   // Continuous tasks buffer several blocks on the driver side:
+   buffer_samples = this->samples;
+   if (this->continuous)
+   {
+      sample_mode = DAQmx_Val_ContSamps;
+      buffer_samples = this->samples * NI_BUFFER_BLOCKS;
+   }
+
+   // Sample events can not be changed while registered:
+   if (this->event_samples > 0)
+   {
+      DAQmxErrChk (
+         DAQmxRegisterEveryNSamplesEvent (this->task, 
+                                          DAQmx_Val_Acquired_Into_Buffer,
+                                          this->event_samples, 0, NULL, NULL));
+      this->event_samples = 0;
+   }
+
+   DAQmxErrChk (
+      DAQmxCfgSampClkTiming (this->task,      //(TaskHandle taskHandle, 
+                             "",                //const char source[], 
+                             rate,              //float64 rate, 
+                             DAQmx_Val_Rising,  //int32 activeEdge, 
+                             sample_mode,       //int32 sampleMode, 
+                             buffer_samples)); // sampsPerChanToAcquire);
+
+   // Read back the rate the hardware timebase was able to produce:
+   if (DAQmxFailed (DAQmxGetSampClkRate (this->task, &this->rate)))
+      this->rate = rate;
+
+   if (this->line_cycles > 0)
+   {
+      samples = (int) (this->rate * period + 0.5);
+      if (samples < 1)
+         samples = 1;
+      if (samples != this->samples)
+      {
+         this->samples = samples;
+         buffer_samples = this->continuous ? this->samples * NI_BUFFER_BLOCKS : samples;
+         DAQmxErrChk (
+            DAQmxCfgSampClkTiming (this->task, "", this->rate, 
+                                   DAQmx_Val_Rising, sample_mode,
+                                   buffer_samples));
+      }
+   }
+
+   // Buffer for reading pending blocks at once
+   free (this->buffer);
+   this->buffer_samples = this->samples * NI_BUFFER_BLOCKS;
+   this->buffer = (float64 *) malloc (sizeof (float64) * this->channels 
+                                      * this->buffer_samples);
+   if (this->buffer == NULL)
+      this->buffer_samples = 0;
+
+   if (this->continuous)
+   {
+      DAQmxErrChk (
+         DAQmxRegisterEveryNSamplesEvent (this->task, 
+                                          DAQmx_Val_Acquired_Into_Buffer,
+                                          this->samples, // uInt32 nSamples,
+                                          0,             // uInt32 options,
+                                          ni_device_block_ready, 
+                                          this));        // callbackData
+      this->event_samples = this->samples;
+   }
+
+   // Shared memory ring with the new layout under the same name
+   if (this->shm.header != NULL 
+       && (this->shm.header->channels != (uint32_t) this->channels
+           || this->shm.header->samples != (uint32_t) this->samples))
+   {
+      char name[sizeof (this->shm_name)];
+      strcpy (name, this->shm_name);
+      ni_device_shm_open (this, name, this->shm.header->slots);
+   }
+}
+
+// Bulk channel configuration. Defined after analog input channels.
+float64 ni_device_table (struct ni_device_data *this,
+                         const struct context_rmcios *context,
+                         enum type_rmcios paramtype,
+                         const union param_rmcios param, int num_params);
+
+void ni_device_func (struct ni_device_data *this,
+                     const struct context_rmcios *context, int id,
+                     enum function_rmcios function,
+                     enum type_rmcios paramtype,
+                     struct combo_rmcios *returnv,
+                     int num_params, const union param_rmcios param)
+{
+   int i;
+   // Calls are serialized with acquisition threads of the device.
+   // Reads use the values published with the sequence counter.
+   ni_lock *held = ni_hold (this != NULL && function != read_rmcios 
+                            ? &this->lock : NULL);
+
+   switch (function)
+   {
+   case help_rmcios:
+      return_string (context, returnv,
+                     "help for niai device. Commands:\r\n"
+                     "create nidev newname \r\n"
+                     "setup newname device_name | sample_rate | samples \r\n"
+                     "setup newname mains line_frequency cycles | sample_rate\r\n"
+                     "   #Blocks integrate exactly cycles mains periods.\r\n"
+                     "   #Give after device name setup, which turns mains\r\n"
+                     "   #synchronization off.\r\n"
+                     "   #Setup returns the sample rate coerced by hardware\r\n"
+                     "   #once the device has channels. Before that it\r\n"
+                     "   #returns the requested rate, and mains samples are\r\n"
+                     "   #computed when the first channels are set up.\r\n"
+                     "setup newname close #stop and release device task\r\n"
+                     "setup newname table name terminal term_cfg minVal maxVal"
+                     " scale ...\r\n"
+                     "   #Create niai channels of all rows in one pass.\r\n"
+                     "   #Replaces present channels of the device.\r\n"
+                     "   #scale: - | linear:gain,offset | poly:c0,c1,...\r\n"
+                     "   #       | table:x0,y0,x1,y1,...\r\n"
+                     "   #Returns configuration time in milliseconds, or -1\r\n"
+                     "   #when the last row is incomplete.\r\n"
+                     "setup newname shm name | slots\r\n"
+                     "   #Publish blocks and channel statistics to shared\r\n"
+                     "   #memory ring for other processes. Ring is recreated\r\n"
+                     "   #when channels or samples change. name none=stop\r\n"
+                     "setup newname overrun stall|drop_oldest|drop_newest"
+                     "|coalesce\r\n"
+                     "   #Handling of blocks piled up in continuous mode\r\n"
+                     "setup newname continuous 1|0\r\n"
+                     "   #1=Hardware clock pushes every block to linked channels\r\n"
+                     "write newname do one measurement\r\n"
+                     "   #Ignored in continuous mode.\r\n"
+                     "read newname #read latest channel values\r\n"
+                     "read newname stats\r\n"
+                     "   #read blocks, last dispatch time to channels,\r\n"
+                     "   #overruns, underflows, dropped and coalesced blocks,\r\n"
+                     "   #largest backlog of samples in driver and blocks\r\n"
+                     "   #not fitting the shared memory layout\r\n");
+      break;
+
+   case create_rmcios:
+      if (num_params < 1)
+         break;
+
+      // allocate new data
+      this = (struct ni_device_data *) malloc (sizeof (struct ni_device_data)); 
+      if (this == NULL) break;
+      
+      // create channel     
+      this->channel_id = create_channel_param (context, paramtype, param, 0, 
+                                               (class_rmcios) ni_device_func, 
+                                               this); 
+
+      //default values:
+      this->name[0] = 0;
+      this->task = 0;
+      this->channels = 0;
+      this->samples = 1;
+      this->rate = 10;
+      this->requested_rate = 10;
+      this->line_frequency = 50;
+      this->line_cycles = 0;
+      this->continuous = 0;
+      this->event_samples = 0;
+      this->context = context;
+      ni_lock_init (&this->lock);
+      this->values_seq = 0;
+      this->next_device = NULL;
+      for (i = 0; i < NI_MAX_CHANNELS; i++)
+      {
+         this->gain[i] = 1;
+         this->offset[i] = 0;
+         this->scales[i] = NULL;
+         this->slots[i] = NULL;
+      }
+      this->blocks = 0;
+      this->dispatch_time = 0;
+      this->shm.header = NULL;
+      this->shm_name[0] = 0;
+      this->buffer = NULL;
+      this->buffer_samples = 0;
+      this->worker = NULL;
+      this->overrun_policy = NI_OVERRUN_STALL;
+      this->overruns = 0;
+      this->underflows = 0;
+      this->dropped = 0;
+      this->coalesced = 0;
+      this->max_backlog = 0;
+      this->shm_dropped = 0;
+
+      //add device to list of NIDAQ devices:
+      ni_device_register (this);
+      ni_register_resource (this, this->channel_id, ni_device_close,
+                            &this->lock);
+
+      // Create the device task
+      DAQmxErrChk (DAQmxCreateTask ("", //const char taskName[], 
+                                    &this->task)); //TaskHandle *taskHandle);
+      break;
+
+   case setup_rmcios:
+      if (this == NULL)
+         break;
+      if (num_params < 1)
+         break;
+      {
+         char cmd_str[20];
+         param_to_string (context, paramtype, param, 0, 
+                          sizeof (cmd_str), cmd_str);  
+         
+         if (strcmp (cmd_str, "close") == 0)
+         {
+            ni_device_close (this);
+            break;
+         }
+         else if (strcmp (cmd_str, "table") == 0)
+         {
+            if (this->name[0] == 0)
+            {
+               printf ("nidev device name not set up\r\n");
+               break;
+            }
+            // Configuration time in milliseconds
+            float64 table_time = ni_device_table (this, context, paramtype, 
+                                                  param, num_params);
+            return_float (context, returnv, 
+                          table_time < 0 ? -1 : table_time * 1e3);
+            break;
+         }
+         else if (strcmp (cmd_str, "shm") == 0)
+         {
+            char name[64];
+            int slots = 16;
+            if (num_params < 2)
+               break;
+            param_to_string (context, paramtype, param, 1, 
+                             sizeof (name), name);
+            if (num_params >= 3)
+               slots = param_to_int (context, paramtype, param, 2);
+            if (strcmp (name, "none") == 0)
+               ni_device_shm_close (this);
+            else
+               ni_device_shm_open (this, name, slots);
+            break;
+         }
+         else if (strcmp (cmd_str, "overrun") == 0)
+         {
+            if (num_params < 2)
+               break;
+            param_to_string (context, paramtype, param, 1, 
+                             sizeof (cmd_str), cmd_str);  
+            this->overrun_policy = NI_OVERRUN_STALL;
+            if (strcmp (cmd_str, "drop_oldest") == 0)
+               this->overrun_policy = NI_OVERRUN_DROP_OLDEST;
+            if (strcmp (cmd_str, "drop_newest") == 0)
+               this->overrun_policy = NI_OVERRUN_DROP_NEWEST;
+            if (strcmp (cmd_str, "coalesce") == 0)
+               this->overrun_policy = NI_OVERRUN_COALESCE;
+            break;
+         }
+         else if (strcmp (cmd_str, "continuous") == 0)
+         {
+            if (num_params < 2)
+               break;
+            this->continuous = param_to_int (context, paramtype, param, 1);
+         }
+         else if (strcmp (cmd_str, "mains") == 0)
+         {
+            if (num_params < 3)
+               break;
+            // 2.line_frequency 3.cycles
+            this->line_frequency = param_to_float (context, paramtype, 
+                                                   param, 1);
+            this->line_cycles = param_to_int (context, paramtype, param, 2);
+            if (this->line_frequency <= 0)
+               this->line_cycles = 0;
+            if (num_params >= 4)
+               // 4.sample_rate
+               this->requested_rate = param_to_float (context, paramtype, 
+                                                      param, 3);
+         }
+         else
+         {
+            // device name
+            strcpy (this->name, cmd_str);
+            this->line_cycles = 0;
+
+            // Reopen closed device
+            if (this->task == 0)
+            {
+               ni_device_register (this);
+               DAQmxErrChk (DAQmxCreateTask ("", &this->task));
+            }
+            
+            if (num_params >= 3)
+               // 3.samples
+               this->samples = param_to_int (context, paramtype, param, 2); 
+            if (num_params >= 2)
+               // 2.sample_rate
+               this->requested_rate = param_to_float (context, paramtype, 
+                                                      param, 1);      
+         }
+         this->rate = this->requested_rate;
+
+         // Apply new timing to already configured channels:
+         if (this->channels > 0)
+         {
+            DAQmxStopTask (this->task);
+            ni_device_cfg_timing (this);
+            if (this->continuous)
+               DAQmxErrChk (DAQmxStartTask (this->task));
+         }
+         return_float (context, returnv, this->rate);
+      }
+      break;
+
+   case write_rmcios:
+      if (this == NULL)
+         break;
+      if (this->continuous)
+         break;
+      if (this->task != 0)
+      {
+         DAQmxStopTask (this->task);
+      }
+      // Create the device task
+      DAQmxErrChk (DAQmxStartTask (this->task));
+      ni_device_acquire (this, context);
+      break;
+
+   case read_rmcios:
+      if (this == NULL)
+         break;
+      if (num_params >= 1)
+      {
+         char cmd_str[20];
+         param_to_string (context, paramtype, param, 0, 
+                          sizeof (cmd_str), cmd_str);  
+         if (strcmp (cmd_str, "stats") == 0)
+         {
+            return_string (context, returnv, "blocks ");
+            ni_return_u64 (context, returnv, this->blocks);
+            return_string (context, returnv, " dispatch_us ");
+            return_float (context, returnv, this->dispatch_time * 1e6);
+            return_string (context, returnv, " overruns ");
+            ni_return_u64 (context, returnv, this->overruns);
+            return_string (context, returnv, " underflows ");
+            ni_return_u64 (context, returnv, this->underflows);
+            return_string (context, returnv, " dropped ");
+            ni_return_u64 (context, returnv, this->dropped);
+            return_string (context, returnv, " coalesced ");
+            ni_return_u64 (context, returnv, this->coalesced);
+            return_string (context, returnv, " max_backlog ");
+            return_int (context, returnv, this->max_backlog);
+            return_string (context, returnv, " shm_dropped ");
+            ni_return_u64 (context, returnv, this->shm_dropped);
+            break;
+         }
+      }
+      {
+         int i, channels;
+         uInt32 seq;
+         float values[NI_MAX_CHANNELS];
+
+         // Consistent copy of values without waiting for acquisition
+         do
+         {
+            seq = ni_seq_read_begin (&this->values_seq);
+            channels = this->channels;
+            memcpy (values, this->values, sizeof (float) * channels);
+         }
+         while (ni_seq_retry (&this->values_seq, seq));
+
+         for (i = 0; i < channels; i++)
+         {
+            return_float (context, returnv, values[i]);
+            return_string (context, returnv, " ");
+         }
+      }
+      break;
+   }
+
+   if (held != NULL)
+      ni_lock_give (held);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Group of NI devices read in parallel
+/////////////////////////////////////////////////////////////////////
+#define NI_MAX_GROUP_DEVICES 16
+
+struct nigroup_data
+{
+   int id;
+   int devices;
+   struct ni_device_data *members[NI_MAX_GROUP_DEVICES];
+   float64 cycle_time;          // time of last group read
+   float64 read_time_sum;       // sum of device read times of last read
+   ni_lock lock;                // one group read or setup at a time
+};
+
+void nigroup_close (void *data)
+{
+   struct nigroup_data *this = (struct nigroup_data *) data;
+   this->devices = 0;
+}
+
+void nigroup_func (struct nigroup_data *this,
+                   const struct context_rmcios *context, int id,
+                   enum function_rmcios function,
+                   enum type_rmcios paramtype,
+                   struct combo_rmcios *returnv,
+                   int num_params, const union param_rmcios param)
+{
+   int i;
+   // Worker results and members are used by one call at a time.
+   // Reads use the times stored atomically.
+   ni_lock *held = ni_hold (this != NULL && function != read_rmcios 
+                            ? &this->lock : NULL);
+
+   switch (function)
+   {
+   case help_rmcios:
+      return_string (context, returnv,
+                     "help for nigroup - read NI devices in parallel\r\n"
+                     "create nigroup newname\r\n"
+                     "setup newname nidev1 nidev2 ...\r\n"
+                     "setup newname close #remove all devices\r\n"
+                     "write newname\r\n"
+                     "   #Measure on all devices at once. Each device is\r\n"
+                     "   #read on its own worker thread and results are\r\n"
+                     "   #processed when all devices are done.\r\n"
+                     "read newname\r\n"
+                     "   #read last cycle time and sum of device read times\r\n");
+      break;
+
+   case create_rmcios:
+      if (num_params < 1)
+         break;
+      // Allocate new data:
+      this = (struct nigroup_data *) malloc (sizeof (struct nigroup_data));
+      if (this == NULL)
+         break;
+
+      // Set default values:
+      this->devices = 0;
+      this->cycle_time = 0;
+      this->read_time_sum = 0;
+      ni_lock_init (&this->lock);
+
+      // Create the channel
+      this->id = create_channel_param (context, paramtype, param, 0,
+                                       (class_rmcios) nigroup_func, this);
+      ni_register_resource (this, this->id, nigroup_close, &this->lock);
+      break;
+
+   case setup_rmcios:
+      if (this == NULL)
+         break;
+      if (ni_is_command (context, paramtype, param, num_params, "close"))
+      {
+         nigroup_close (this);
+         break;
+      }
+      this->devices = 0;
+      for (i = 0; i < num_params && i < NI_MAX_GROUP_DEVICES; i++)
+      {
+         struct ni_device_data *device =
+            get_ni_device_for_channel (param_to_int
+                                       (context, paramtype, param, i));
+         if (device == NULL)
+         {
+            printf ("No NI device channel: %s\r\n",
+                    param_to_string (context, paramtype, param, i, 0, NULL));
+            continue;
+         }
+         this->members[this->devices++] = device;
+      }
+      break;
+
+   case write_rmcios:
+      if (this == NULL)
+         break;
+      {
+         float64 start = ni_time ();
+         float64 read_time_sum = 0;
+         int results[NI_MAX_GROUP_DEVICES];
+
+         // One read in flight per device
+         for (i = 0; i < this->devices; i++)
+         {
+            struct ni_device_data *device = this->members[i];
+            if (device->task != 0 && !device->continuous)
+               ni_worker_start (device);
+         }
+
+         for (i = 0; i < this->devices; i++)
+         {
+            struct ni_device_data *device = this->members[i];
+            results[i] = 0;
+            if (device->task != 0 && !device->continuous)
+            {
+               results[i] = ni_worker_join (device);
+               if (device->worker != NULL)
+                  read_time_sum += device->worker->read_time;
+            }
+         }
+         ni_store_f64 (&this->read_time_sum, read_time_sum);
+         ni_store_f64 (&this->cycle_time, ni_time () - start);
+
+         // Results to channels from the calling thread
+         for (i = 0; i < this->devices; i++)
+         {
+            struct ni_device_data *device = this->members[i];
+            if (results[i] <= 0)
+               continue;
+            // Block of a reconfigured device is not processed
+            ni_lock_take (&device->lock);
+            if (device->channels == device->worker->channels)
+               ni_device_process (device, context, device->worker->block, 
+                                  results[i]);
+            ni_lock_give (&device->lock);
+         }
+      }
+      break;
+
+   case read_rmcios:
+      if (this == NULL)
+         break;
+      return_string (context, returnv, "cycle_us ");
+      return_float (context, returnv, ni_load_f64 (&this->cycle_time) * 1e6);
+      return_string (context, returnv, " read_sum_us ");
+      return_float (context, returnv, 
+                    ni_load_f64 (&this->read_time_sum) * 1e6);
+      break;
+   }
+
+   if (held != NULL)
+      ni_lock_give (held);
+}
+
+// Terminal configuration by name. Unknown names use the device default.
+int ni_term_cfg (const char *name)
+{
+   if (strcmp (name, "RSE") == 0)
+      return DAQmx_Val_RSE;
+   if (strcmp (name, "NRSE") == 0)
+      return DAQmx_Val_NRSE;
+   if (strcmp (name, "Diff") == 0)
+      return DAQmx_Val_Diff;
+   if (strcmp (name, "PseudoDiff") == 0)
+      return DAQmx_Val_PseudoDiff;
+   return DAQmx_Val_Cfg_Default;
+}
+
+// Set calibration of device channel. 
+// type: linear (gain offset), poly (c0 c1 ...), table (x0 y0 x1 y1 ...)
+// Other types remove the calibration. Invalid tables keep the old one.
+void ni_device_set_scale (struct ni_device_data *device, int ch,
+                          const char *type, const float64 *v, int n)
+{
+   struct ni_scale *scale;
+   int i;
+
+   // Interpolation needs segments with increasing x
+   if (strcmp (type, "table") == 0)
+   {
+      int points = n / 2;
+      if (points > NI_SCALE_POINTS)
+         points = NI_SCALE_POINTS;
+      for (i = 1; i < points; i++)
+      {
+         if (!(v[i * 2] > v[(i - 1) * 2]))
+            break;
+      }
+      if (points < 2 || i < points)
+      {
+         printf ("Scale table needs 2 or more points "
+                 "with increasing x\r\n");
+         return;
+      }
+   }
+
+   free (device->scales[ch]);
+   device->scales[ch] = NULL;
+   device->gain[ch] = 1;
+   device->offset[ch] = 0;
+
+   if (strcmp (type, "linear") == 0)
+   {
+      if (n >= 1)
+         device->gain[ch] = v[0];
+      if (n >= 2)
+         device->offset[ch] = v[1];
+   }
+   else if (strcmp (type, "poly") == 0 || strcmp (type, "table") == 0)
+   {
+      scale = (struct ni_scale *) malloc (sizeof (struct ni_scale));
+      if (scale == NULL)
+         return;
+      scale->type = NI_SCALE_POLY;
+      scale->n = n;
+      if (strcmp (type, "table") == 0)
+      {
+         scale->type = NI_SCALE_TABLE;
+         scale->n = n / 2;
+      }
+      if (scale->n > NI_SCALE_POINTS)
+         scale->n = NI_SCALE_POINTS;
+      if (scale->n < 1)
+      {
+         free (scale);
+         return;
+      }
+      for (i = 0; i < scale->n; i++)
+      {
+         if (scale->type == NI_SCALE_POLY)
+         {
+            scale->c[i] = v[i];
+         }
+         else
+         {
+            scale->x[i] = v[i * 2];
+            scale->c[i] = v[i * 2 + 1];
+         }
+      }
+      device->scales[ch] = scale;
+   }
+}
+
+// Move used slots of device to the front and release calibration of 
+// unused slots
+void ni_device_compact_slots (struct ni_device_data *this)
+{
+   int ch, n = 0;
+   for (ch = 0; ch < this->channels; ch++)
+   {
+      struct niai_data *slot = this->slots[ch];
+      if (slot == NULL)
+      {
+         free (this->scales[ch]);
+         continue;
+      }
+      this->slots[n] = slot;
+      this->scales[n] = this->scales[ch];
+      this->gain[n] = this->gain[ch];
+      this->offset[n] = this->offset[ch];
+      slot->channel_index = n;
+      n++;
+   }
+   for (ch = n; ch < this->channels; ch++)
+   {
+      this->slots[ch] = NULL;
+      this->scales[ch] = NULL;
+      this->gain[ch] = 1;
+      this->offset[ch] = 0;
+   }
+   this->channels = n;
+}
+
+// Recreate the device task from its analog input slots. Consecutive slots
+// with same terminal configuration and range are created with one comma 
+// separated physical channel list. Slots of channels refused by the driver
+// are detached. Caller holds the device lock.
+void ni_device_rebuild (struct ni_device_data *this)
+{
+   int name_len = strlen (this->name);
+   int first, ch, failed = 0;
+   char *list;
+
+   ni_device_compact_slots (this);
+
+   // Clearing the task also unregisters its sample events
+   ni_clear_task (&this->task);
+   this->event_samples = 0;
+   DAQmxErrChk (DAQmxCreateTask ("", &this->task));
+   if (this->channels == 0)
+      return;
+
+   // Worst case list has every channel of the device
+   list = (char *) malloc (this->channels 
+                           * (name_len + sizeof (this->slots[0]->terminal) 
+                              + 2) + 1);
+   for (first = 0; first < this->channels; first = ch)
+   {
+      struct niai_data *run = this->slots[first];
+      char *p = list;
+      int32 error = -1;
+
+      for (ch = first; ch < this->channels; ch++)
+      {
+         struct niai_data *slot = this->slots[ch];
+         if (slot->term_cfg != run->term_cfg 
+             || slot->min_val != run->min_val
+             || slot->max_val != run->max_val)
+            break;
+         if (list == NULL)
+            continue;
+         if (ch > first)
+            *p++ = ',';
+         memcpy (p, this->name, name_len);
+         p += name_len;
+         *p++ = '/';
+         strcpy (p, slot->terminal);
+         p += strlen (slot->terminal);
+      }
+
+      if (list != NULL)
+      {
+         error = DAQmxCreateAIVoltageChan (this->task, list, "", 
+                                           run->term_cfg, run->min_val, 
+                                           run->max_val, DAQmx_Val_Volts, 
+                                           "");
+         DAQmxErrChk (error);
+      }
+      if (DAQmxFailed (error))
+      {
+         int i;
+         for (i = first; i < ch; i++)
+         {
+            this->slots[i]->device = NULL;
+            this->slots[i] = NULL;
+         }
+         failed = 1;
+      }
+   }
+   free (list);
+
+   // Slots match the channels of the task again
+   if (failed)
+      ni_device_compact_slots (this);
+   if (this->channels == 0)
+      return;
+
+   ni_device_cfg_timing (this);
+   DAQmxErrChk (DAQmxStartTask (this->task));
+}
+
+// Default values of new analog input
+void niai_init (struct niai_data *this, const char *name)
+{
+   strncpy (this->name, name, sizeof (this->name) - 1);
+   this->name[sizeof (this->name) - 1] = 0;
+   this->channel_index = 0;
+   this->value = 0;
+   this->device = NULL;
+   this->trigger = NULL;
+   this->hooks = NULL;
+   this->terminal[0] = 0;
+   this->term_cfg = DAQmx_Val_Cfg_Default;
+   this->min_val = -10.0;
+   this->max_val = 10.0;
+}
+
+// Detach analog input from its device slot. The device task is rebuilt 
+// without its channel.
+void niai_close (void *data)
+{
+   struct niai_data *this = (struct niai_data *) data;
+   struct ni_device_data *device = this->device;
+   if (device != NULL)
+   {
+      ni_lock_take (&device->lock);
+      if (device->slots[this->channel_index] == this)
+         device->slots[this->channel_index] = NULL;
+      this->device = NULL;
+      ni_device_rebuild (device);
+      ni_lock_give (&device->lock);
+   }
+   ni_trigger_free (this->trigger);
+   this->trigger = NULL;
+   while (this->hooks != NULL)
+      ni_hook_remove (&this->hooks, this->hooks->data);
+}
+
+// Find analog input created by the module by channel name
+struct niai_data *niai_find (const char *name)
+{
+   struct ni_resource *resource;
+   for (resource = first_ni_resource; resource != NULL; 
+        resource = resource->next)
+   {
+      struct niai_data *ai = (struct niai_data *) resource->data;
+      if (resource->close == niai_close && strcmp (ai->name, name) == 0)
+         return ai;
+   }
+   return NULL;
+}
+
+void nidaq_ai_func (struct niai_data *this,
+                    const struct context_rmcios *context, int id,
+                    enum function_rmcios function,
+                    enum type_rmcios paramtype,
+                    struct combo_rmcios *returnv,
+                    int num_params, const union param_rmcios param)
+{
+   // Slot, scale and trigger changes are serialized with the acquisition
+   // of the device. Reads use the atomically stored value.
+   ni_lock *held = ni_hold (this != NULL && this->device != NULL 
+                            && function != read_rmcios 
+                            ? &this->device->lock : NULL);
+
+   switch (function)
+   {
+   case help_rmcios:
+      return_string (context, returnv,
+                     "help for niai - NI analog input\r\n"
+                     " create niai newname\r\n"
+                     " setup newname ni_device_channel | terminal\r\n"
+                     "               | term_cfg(RSE NRSE Diff PseudoDiff) \r\n"
+                     "               | minVal maxVal\r\n"
+                     " setup newname scale linear gain offset\r\n"
+                     " setup newname scale poly c0 c1 c2 ...\r\n"
+                     " setup newname scale table x0 y0 x1 y1 ...\r\n"
+                     " setup newname scale none\r\n"
+                     "   #Convert volts to engineering units in the device\r\n"
+                     "   #block reduction. Table has 2 or more points with\r\n"
+                     "   #strictly increasing x.\r\n"
+                     " setup newname trigger level|rising|falling level"
+                     " | pre post\r\n"
+                     " setup newname trigger window low high | pre post\r\n"
+                     " setup newname trigger none\r\n"
+                     "   #Send pre+post samples around trigger to linked\r\n"
+                     "   #channels instead of block averages.\r\n"
+                     " setup newname close #detach from device slot\r\n"
+                     " read newname #read latest analog value \r\n"
+                     " link newname linked_ch #link output to channel \r\n"
+                     "   #Device hands each block value directly to niai \r\n");
+      break;
+   case create_rmcios: 
+      // params: channel_name=0 device_channel=1 
+      // term_cfg(RSE NRSE Diff PseudoDiff)=2 minVal=3 maxVal=4
+      if (num_params < 1)
+      {
+         printf ("Not enough parameters\r\n");
+         break;
+      }
+      // allocate new data
+      this = (struct niai_data *) malloc (sizeof (struct niai_data));   
+      if (this == NULL) break;
+      
+      // create channel
+      this->id = create_channel_param (context, paramtype, param, 0, 
+                                       (class_rmcios) nidaq_ai_func, this);
+      
+      // Default values: 
+      {
+         char name[64];
+         param_to_string (context, paramtype, param, 0, sizeof (name), name);
+         niai_init (this, name);
+      }
+      ni_register_resource (this, this->id, niai_close, NULL);
+      break;
+
+   case setup_rmcios:
+      if (this == NULL) break;
+      if (num_params < 1)
+         break;
+      {
+         int i;
+         char term_str[30], term_cfg_str[15];
+
+         param_to_string (context, paramtype, param, 0,
+                          sizeof (term_str), term_str);
+         if (strcmp (term_str, "close") == 0)
+         {
+            niai_close (this);
+            break;
+         }
+         if (num_params < 2)
+            break;
+         if (strcmp (term_str, "trigger") == 0)
+         {
+            int type = 0;
+            int index = 3;
+            float64 low = 0, high = 0;
+            int pre = 100, post = 100;
+
+            param_to_string (context, paramtype, param, 1,
+                             sizeof (term_str), term_str);
+            if (strcmp (term_str, "level") == 0)
+               type = NI_TRIG_LEVEL;
+            if (strcmp (term_str, "rising") == 0)
+               type = NI_TRIG_RISING;
+            if (strcmp (term_str, "falling") == 0)
+               type = NI_TRIG_FALLING;
+            if (strcmp (term_str, "window") == 0)
+               type = NI_TRIG_WINDOW;
+
+            if (num_params >= 3)
+               low = param_to_float (context, paramtype, param, 2);
+            if (type == NI_TRIG_WINDOW)
+            {
+               if (num_params >= 4)
+                  high = param_to_float (context, paramtype, param, 3);
+               index = 4;
+            }
+            if (num_params >= index + 2)
+            {
+               pre = param_to_int (context, paramtype, param, index);
+               post = param_to_int (context, paramtype, param, index + 1);
+            }
+
+            ni_trigger_free (this->trigger);
+            this->trigger = NULL;
+            if (type != 0)
+               this->trigger = ni_trigger_new (type, low, high, pre, post);
+            break;
+         }
+         if (strcmp (term_str, "scale") == 0)
+         {
+            struct ni_device_data *device = this->device;
+            int ch = this->channel_index;
+            if (device == NULL)
+            {
+               printf ("niai not set up\r\n");
+               break;
+            }
+
+            float64 v[NI_SCALE_POINTS * 2];
+            int n = num_params - 2;
+            if (n > NI_SCALE_POINTS * 2)
+               n = NI_SCALE_POINTS * 2;
+            for (i = 0; i < n; i++)
+               v[i] = param_to_float (context, paramtype, param, 2 + i);
+
+            param_to_string (context, paramtype, param, 1,
+                             sizeof (term_str), term_str);
+            ni_device_set_scale (device, ch, term_str, v, n);
+            break;
+         }
+
+         // Get the NI device for given channel:
+         struct ni_device_data *device =
+            get_ni_device_for_channel (param_to_int
+                                       (context, paramtype, param, 0));
+         if (device == NULL)
+         {
+            printf ("NO NI device channel: %s\r\n",
+                    param_to_string (context, paramtype, param, 1, 0, NULL));
+            break;
+         }
+         
+         // Build physical channel string:
+         param_to_string (context, paramtype, param, 1,
+                          sizeof (term_str), term_str);
+
+         char physicalChannel[strlen (term_str) + strlen (device->name) + 3];
+         strcpy (physicalChannel, device->name);
+         strcat (physicalChannel, "/");
+         strcat (physicalChannel, term_str);
+
+         int term_cfg = DAQmx_Val_Cfg_Default;
+         if (num_params >= 3)
+         {
+            param_to_string (context, paramtype, param, 2,
+                             sizeof (term_cfg_str), term_cfg_str);
+            term_cfg = ni_term_cfg (term_cfg_str);
+         }
+         float64 minVal = -10.0, maxVal = 10.0;
+
+         if (num_params >= 5)
+         {
+            minVal = param_to_float (context, paramtype, param, 3);
+            maxVal = param_to_float (context, paramtype, param, 4);
+         }
+
+         // Same device: slot keeps its place and the task is rebuilt with
+         // the new settings.
+         if (device == this->device)
+         {
+            strcpy (this->terminal, term_str);
+            this->term_cfg = term_cfg;
+            this->min_val = minVal;
+            this->max_val = maxVal;
+            ni_device_rebuild (device);
+            if (this->device != NULL)
+               return_int (context, returnv, this->channel_index);
+            break;
+         }
+
+         // Old device is released before locking the new one to keep
+         // only one device lock held at a time.
+         struct ni_device_data *old_device = this->device;
+         int old_index = this->channel_index;
+         if (held != NULL)
+         {
+            ni_lock_give (held);
+            held = NULL;
+         }
+         ni_lock_take (&device->lock);
+
+         if (device->channels >= NI_MAX_CHANNELS)
+         {
+            ni_lock_give (&device->lock);
+            printf ("Too many channels on NI device\r\n");
+            break;
+         }
+
+         /////////////////////////////////////////
+         // Configure the NI device:
+         /////////////////////////////////////////
+
+         if (device->task != 0)
+         {
+            DAQmxStopTask (device->task);
+         }
+         int32 error = 
+            DAQmxCreateAIVoltageChan (device->task, // (TaskHandle taskHandle, 
+                                      physicalChannel,  
+                                      "", //nameToAssignToChannel[], 
+                                      term_cfg, //int32 terminalConfig, 
+                                      minVal, //float64 minVal, 
+                                      maxVal, //float64 maxVal, 
+                                      DAQmx_Val_Volts,  //int32 units, 
+                                      "");  //const char customScaleName[]);
+         DAQmxErrChk (error);
+         if (DAQmxFailed (error))
+         {
+            // Channel stays on its old device
+            if (device->channels > 0)
+               DAQmxErrChk (DAQmxStartTask (device->task));
+            ni_lock_give (&device->lock);
+            break;
+         }
+
+         // Move this channel to new device slot:
+         strcpy (this->terminal, term_str);
+         this->term_cfg = term_cfg;
+         this->min_val = minVal;
+         this->max_val = maxVal;
+         this->channel_index = device->channels;
+         this->device = device;
+         device->slots[this->channel_index] = this;
+         device->channels++;
+
+         ni_device_cfg_timing (device);
+
+         DAQmxErrChk (DAQmxStartTask (device->task)); //(TaskHandle *taskHandle);
+         int index = this->channel_index;
+         ni_lock_give (&device->lock);
+
+         // Channel is removed from the task of the old device
+         if (old_device != NULL)
+         {
+            ni_lock_take (&old_device->lock);
+            if (old_device->slots[old_index] == this)
+               old_device->slots[old_index] = NULL;
+            ni_device_rebuild (old_device);
+            ni_lock_give (&old_device->lock);
+         }
+         return_int (context, returnv, index);
+      }
+
+      break;
+
+   case read_rmcios:
+      if (this == NULL)
+         break;
+      return_float (context, returnv, ni_load_f (&this->value));
+      break;
+
+   case write_rmcios:
+      if (this == NULL)
+         break;
+      if (num_params <= this->channel_index)
+         break;
+      ni_store_f (&this->value, param_to_float (context, paramtype, param, 
+                                                this->channel_index));
+      write_f (context, linked_channels (context, id), this->value);
+      break;
+   }
+
+   if (held != NULL)
+      ni_lock_give (held);
+}
+
+// Columns of one row of the nidev channel table
+#define NI_TABLE_COLUMNS 6
+
+// Bulk configuration of all analog inputs of a device:
+// params: table name terminal term_cfg minVal maxVal scale ...
+// Replaces present channels of the device. Existing niai channels are 
+// reused by name, new ones are created. The task is rebuilt once with one
+// comma separated physical channel list per run of rows with same terminal
+// configuration and range. Returns configuration time in seconds, or -1
+// when the last row is incomplete and the device was left unchanged.
+float64 ni_device_table (struct ni_device_data *this,
+                         const struct context_rmcios *context,
+                         enum type_rmcios paramtype,
+                         const union param_rmcios param, int num_params)
+{
+   float64 start = ni_time ();
+   int rows = (num_params - 1) / NI_TABLE_COLUMNS;
+   char name[64], cfg_str[15], scale_str[256];
+   int row, ch;
+
+   if ((num_params - 1) % NI_TABLE_COLUMNS != 0)
+   {
+      printf ("Table rows need %d columns: name terminal term_cfg "
+              "minVal maxVal scale\r\n", NI_TABLE_COLUMNS);
+      return -1;
+   }
+   if (rows > NI_MAX_CHANNELS)
+   {
+      printf ("Too many channels on NI device\r\n");
+      rows = NI_MAX_CHANNELS;
+   }
+
+   // Present inputs are detached. Inputs named in the table come back.
+   for (ch = 0; ch < this->channels; ch++)
+   {
+      if (this->slots[ch] != NULL)
+         this->slots[ch]->device = NULL;
+      this->slots[ch] = NULL;
+      free (this->scales[ch]);
+      this->scales[ch] = NULL;
+      this->gain[ch] = 1;
+      this->offset[ch] = 0;
+   }
+   this->channels = 0;
+   if (this->task == 0)
+      ni_device_register (this);
+
+   // Channels, slots and calibration of every row
+   for (row = 0; row < rows; row++)
+   {
+      int col = 1 + row * NI_TABLE_COLUMNS;
+      struct niai_data *ai;
+      float64 v[NI_SCALE_POINTS * 2];
+      int n = 0;
+      char *type, *s;
+
+      param_to_string (context, paramtype, param, col, sizeof (name), name);
+      ai = niai_find (name);
+      if (ai == NULL)
+      {
+         ai = (struct niai_data *) malloc (sizeof (struct niai_data));
+         if (ai == NULL)
+            break;
+         niai_init (ai, name);
+         ai->id = create_channel_str (context, name, 
+                                      (class_rmcios) nidaq_ai_func, ai);
+         ni_register_resource (ai, ai->id, niai_close, NULL);
+      }
+      else if (ai->device == this)
+      {
+         printf ("Channel %s already in table\r\n", name);
+         continue;
+      }
+      else if (ai->device != NULL)
+      {
+         // Input moves from another device. Configuration is expected 
+         // from one thread, so the nested device lock is taken here.
+         struct ni_device_data *device = ai->device;
+         ni_lock_take (&device->lock);
+         if (device->slots[ai->channel_index] == ai)
+            device->slots[ai->channel_index] = NULL;
+         ai->device = NULL;
+         ni_device_rebuild (device);
+         ni_lock_give (&device->lock);
+      }
+
+      param_to_string (context, paramtype, param, col + 1, 
+                       sizeof (ai->terminal), ai->terminal);
+      param_to_string (context, paramtype, param, col + 2, 
+                       sizeof (cfg_str), cfg_str);
+      ai->term_cfg = ni_term_cfg (cfg_str);
+      ai->min_val = param_to_float (context, paramtype, param, col + 3);
+      ai->max_val = param_to_float (context, paramtype, param, col + 4);
+      ai->channel_index = this->channels;
+      ai->device = this;
+      this->slots[this->channels] = ai;
+
+      // Scale: - | linear:gain,offset | poly:c0,c1,.. | table:x0,y0,..
+      param_to_string (context, paramtype, param, col + 5, 
+                       sizeof (scale_str), scale_str);
+      type = scale_str;
+      s = strchr (scale_str, ':');
+      if (s != NULL)
+      {
+         *s++ = 0;
+         while (*s != 0 && n < NI_SCALE_POINTS * 2)
+         {
+            char *end;
+            v[n] = strtod (s, &end);
+            if (end == s)
+               break;
+            n++;
+            s = end;
+            if (*s == ',')
+               s++;
+         }
+         ni_device_set_scale (this, this->channels, type, v, n);
+      }
+      this->channels++;
+   }
+
+   // Rows refused by the driver are detached from the device
+   ni_device_rebuild (this);
+   return ni_time () - start;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Output watchdog
+///////////////////////////////////////////////////////////////////////////
+// Check interval of the watchdog thread in seconds
+#define NI_WATCHDOG_PERIOD 0.01
+
+// Deadline of an output channel. Embedded in output channel data.
+// Fields are protected by the lock of the output channel. Watched outputs
+// stay in the list until module unload, so the watchdog thread walks it
+// without the list lock.
+struct ni_watchdog
+{
+   float64 timeout;             // seconds without update. 0=disabled
+   float64 last_update;         // time of last output update
+   int tripped;                 // output is in safe state
+   uInt64 trips;                // number of missed deadlines
+   ni_lock *lock;               // lock of the output channel
+   void (*safe) (void *data);   // drives output to safe state, lock held
+   void *data;
+   struct ni_watchdog *next;
+};
+
+struct ni_watchdog *first_ni_watchdog = NULL;
+ni_lock ni_watchdog_list_lock;
+ni_thread ni_watchdog_thread;
+volatile int ni_watchdog_running = 0;
+
+// Timer thread that drives outputs with missed deadline to safe state
+NI_THREAD_FUNC (ni_watchdog_func, arg)
+{
+   struct ni_watchdog *watchdog;
+   while (ni_watchdog_running)
+   {
+      float64 now = ni_time ();
+      for (watchdog = __atomic_load_n (&first_ni_watchdog, __ATOMIC_ACQUIRE);
+           watchdog != NULL; watchdog = watchdog->next)
+      {
+         ni_lock_take (watchdog->lock);
+         if (watchdog->timeout > 0 && !watchdog->tripped 
+             && now - watchdog->last_update > watchdog->timeout)
+         {
+            watchdog->safe (watchdog->data);
+            watchdog->tripped = 1;
+            watchdog->trips++;
+         }
+         ni_lock_give (watchdog->lock);
+      }
+      ni_sleep (NI_WATCHDOG_PERIOD);
+   }
+   return 0;
+}
+
+// Mark output as updated. Called with the output lock held.
+void ni_watchdog_feed (struct ni_watchdog *watchdog)
+{
+   watchdog->last_update = ni_time ();
+   watchdog->tripped = 0;
+}
+
+void ni_watchdog_init (struct ni_watchdog *watchdog, ni_lock *lock,
+                       void (*safe) (void *data), void *data)
+{
+   watchdog->timeout = 0;
+   watchdog->last_update = 0;
+   watchdog->tripped = 0;
+   watchdog->trips = 0;
+   watchdog->lock = lock;
+   watchdog->safe = safe;
+   watchdog->data = data;
+   watchdog->next = NULL;
+}
+
+// Set deadline of output and start watching it
+void ni_watchdog_start (struct ni_watchdog *watchdog, float64 timeout)
+{
+   struct ni_watchdog *w;
+
+   if (ni_watchdog_running == 0)
+   {
+      ni_lock_init (&ni_watchdog_list_lock);
+      ni_watchdog_running = 1;
+      if (!ni_thread_start (&ni_watchdog_thread, ni_watchdog_func, NULL))
+      {
+         printf ("Could not start NI watchdog thread\r\n");
+         ni_watchdog_running = 0;
+         ni_lock_free (&ni_watchdog_list_lock);
+         return;
+      }
+   }
+
+   ni_lock_take (watchdog->lock);
+   watchdog->timeout = timeout;
+   ni_watchdog_feed (watchdog);
+   ni_lock_give (watchdog->lock);
+
+   ni_lock_take (&ni_watchdog_list_lock);
+   for (w = first_ni_watchdog; w != NULL && w != watchdog; w = w->next);
+   if (w == NULL)
+   {
+      watchdog->next = first_ni_watchdog;
+      __atomic_store_n (&first_ni_watchdog, watchdog, __ATOMIC_RELEASE);
+   }
+   ni_lock_give (&ni_watchdog_list_lock);
+}
+
+// Stop watching output
+void ni_watchdog_stop (struct ni_watchdog *watchdog)
+{
+   ni_lock_take (watchdog->lock);
+   watchdog->timeout = 0;
+   ni_lock_give (watchdog->lock);
+}
+
+// Return number of missed deadlines and 1 while output is in safe state.
+// Called with the lock of the output held.
+void ni_watchdog_stats (struct ni_watchdog *watchdog,
+                        const struct context_rmcios *context,
+                        struct combo_rmcios *returnv)
+{
+   return_string (context, returnv, "trips ");
+   ni_return_u64 (context, returnv, watchdog->trips);
+   return_string (context, returnv, " tripped ");
+   return_int (context, returnv, watchdog->tripped);
+}
+
+// Stop the watchdog thread
+void ni_watchdog_shutdown (void)
+{
+   if (ni_watchdog_running == 0)
+      return;
+   ni_watchdog_running = 0;
+   ni_thread_join (ni_watchdog_thread);
+   first_ni_watchdog = NULL;
+   ni_lock_free (&ni_watchdog_list_lock);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Analog output
+///////////////////////////////////////////////////////////////////////////
+struct niao_data
+{
+   int id;
+   TaskHandle task;
+   float value;
+   float64 minVal;
+   float64 maxVal;
+   float64 safe_value;          // output on missed watchdog deadline
+   ni_lock lock;                // serializes output writes
+   struct ni_watchdog watchdog;
+};
+
+// Write output voltage to the task. Called with the lock held.
+void niao_write (struct niao_data *this, float64 value)
+{
+   if (this->task == 0)
+      return;
+   this->value = value;
+   DAQmxErrChk (DAQmxWriteAnalogScalarF64 (this->task, // (TaskHandle  
+                                           0,   //bool32 autoStart, 
+                                           0.5, //float64 timeout, 
+                                           this->value,  //float64 value, 
+                                           NULL));   //bool32 *reserved);
+}
+
+// Write new output voltage
+void niao_apply (struct niao_data *this, float64 value)
+{
+   ni_lock_take (&this->lock);
+   niao_write (this, value);
+   ni_watchdog_feed (&this->watchdog);
+   ni_lock_give (&this->lock);
+}
+
+void niao_safe (void *data)
+{
+   struct niao_data *this = (struct niao_data *) data;
+   niao_write (this, this->safe_value);
+}
+
+void niao_close (void *data)
+{
+   struct niao_data *this = (struct niao_data *) data;
+   ni_watchdog_stop (&this->watchdog);
+   ni_lock_take (&this->lock);
+   ni_clear_task (&this->task);
+   ni_lock_give (&this->lock);
+}
+
+void nidaq_ao_func (struct niao_data *this,
+                    const struct context_rmcios *context, int id,
+                    enum function_rmcios function,
+                    enum type_rmcios paramtype,
+                    struct combo_rmcios *returnv,
+                    int num_params, const union param_rmcios param)
+{
+   ni_lock *held = ni_hold (this != NULL ? &this->lock : NULL);
+
+   switch (function)
+   {
+   case help_rmcios:
+      return_string (context, returnv,
+                     "help for niao.\r\n"
+                     " create niao newname\r\n"
+                     " setup newname device_channel terminal | minVal maxVal\r\n"
+                     " setup newname close #stop and release task\r\n"
+                     " setup newname watchdog timeout | safe_value\r\n"
+                     "   #Write safe_value (default 0) when not written\r\n"
+                     "   #for timeout seconds. timeout 0 disables.\r\n"
+                     " write newname value\r\n"
+                     " read newname\r\n"
+                     " read newname stats\r\n"
+                     "   #watchdog trips and tripped 1 while in safe state\r\n");
+      break;
+
+   case create_rmcios:
+      if (num_params < 1)
+         break;
+
+      // allocate new data
+      this = (struct niao_data *) malloc (sizeof (struct niao_data));   
+      // create channel       
+      this->id = create_channel_param (context, paramtype, param, 0, 
+                                       (class_rmcios) nidaq_ao_func, this);  
+
+      //default values:
+      this->task = 0;
+      this->value = 0;
+      this->minVal = -10.0;
+      this->maxVal = 10.0;
+      this->safe_value = 0;
+      ni_lock_init (&this->lock);
+      ni_watchdog_init (&this->watchdog, &this->lock, niao_safe, this);
+      ni_register_resource (this, this->id, niao_close,
+                            &this->lock);
+      break;
+
+   case setup_rmcios:
+      if (this == NULL)
+         break;
+      if (ni_is_command (context, paramtype, param, num_params, "close"))
+      {
+         niao_close (this);
+         break;
+      }
+      if (ni_is_command (context, paramtype, param, num_params, "watchdog"))
+      {
+         if (num_params >= 3)
+            this->safe_value = param_to_float (context, paramtype, param, 2);
+         if (num_params >= 2)
+            ni_watchdog_start (&this->watchdog, 
+                               param_to_float (context, paramtype, param, 1));
+         break;
+      }
+      if (num_params < 2)
+         break;
+      if (num_params >= 4)
+      {
+         this->minVal = param_to_float (context, paramtype, param, 2);
+         this->maxVal = param_to_float (context, paramtype, param, 3);
+      }
+
+      if (this->task != 0)
+      {
+         DAQmxErrChk (DAQmxStopTask (this->task));  //(TaskHandle taskHandle);
+         DAQmxErrChk (DAQmxClearTask (this->task)); //(TaskHandle taskHandle);
+         this->task = 0;
+      }
+
+      // Get the NI device for given channel:
+      struct ni_device_data *device =
+         get_ni_device_for_channel (param_to_int
+                                    (context, paramtype, param, 0));
+      if (device == NULL)
+      {
+         printf ("NO NI device channel: %s\r\n",
+                 param_to_string (context, paramtype, param, 0, 0, NULL));
+         break;
+      }
+      else
+      {
+         // Build physical channel string:
+         char term_str[20];
+         param_to_string (context, paramtype, param, 1,
+                          sizeof (term_str), term_str);
+
+         char physicalChannel[strlen (term_str) + strlen (device->name) + 3];
+         strcpy (physicalChannel, device->name);
+         strcat (physicalChannel, "/");
+         strcat (physicalChannel, term_str);
+
+         DAQmxErrChk (DAQmxCreateTask ("", //const char taskName[], 
+                                       &this->task)); //TaskHandle *taskHandle);
+
+         DAQmxErrChk (
+               DAQmxCreateAOVoltageChan (this->task,//(TaskHandle taskHandle, 
+                                         physicalChannel,  
+                                         "", //nameToAssignToChannel[], 
+                                         this->minVal, //float64 minVal, 
+                                         this->maxVal, //float64 maxVal, 
+                                         DAQmx_Val_Volts, //int32 units, 
+                                         "")); //const char customScaleName[]);
+
+         DAQmxErrChk (DAQmxStartTask (this->task));
+      }
+      break;
+
+   case write_rmcios:
+      if (this == NULL)
+         break;
+      if (num_params < 1)
+         break;
+      if (this->task == 0)
+         break;
+
+      niao_apply (this, param_to_float (context, paramtype, param, 0));
+      write_f (context, linked_channels (context, id), this->value);
+      break;
+
+   case read_rmcios:
+      if (this == NULL)
+         break;
+      if (ni_is_command (context, paramtype, param, num_params, "stats"))
+      {
+         ni_watchdog_stats (&this->watchdog, context, returnv);
+         break;
+      }
+      return_float (context, returnv, this->value);
+      break;
+   }
+
+   if (held != NULL)
+      ni_lock_give (held);
+}
+
+////////////////////////////////////////////////////////////////////
+// PWM output
+////////////////////////////////////////////////////////////////////
+struct nipwm_data
+{
+   int id;
+   TaskHandle task;
+   float64 duty;                // 
+   float64 frequency;           // in hz
+   int idle_state;              // 1 or 0 ;
+   float64 safe_duty;           // duty on missed watchdog deadline
+   ni_lock lock;                // serializes output writes
+   struct ni_watchdog watchdog;
+};
+
+// Duty cycle limits of the pulse output
+#define NIPWM_MIN_DUTY 0.001
+#define NIPWM_MAX_DUTY 0.999
+
+// Write duty cycle to the task, limited to the range of the pulse output.
+// Called with the lock held.
+void nipwm_write (struct nipwm_data *this, float64 duty)
+{
+   int32 written;
+   if (this->task == 0)
+      return;
+   this->duty = duty;
+   if (this->duty > NIPWM_MAX_DUTY)
+      this->duty = NIPWM_MAX_DUTY;
+   if (this->duty < NIPWM_MIN_DUTY)
+      this->duty = NIPWM_MIN_DUTY;
+
+   DAQmxErrChk (DAQmxWriteCtrFreq (this->task, //(TaskHandle taskHandle, 
+                                   1,        //int32 numSampsPerChan, 
+                                   0,        //bool32 autoStart, 
+                                   1.0,      //float64 timeout,
+                                   DAQmx_Val_GroupByChannel, // dataLayout, 
+                                   &(this->frequency), // float64 frequency[],
+                                   &(this->duty),    //  float64 dutyCycle[], 
+                                   &written, // *numSampsPerChanWritten,
+                                   NULL));   // bool32 *reserved);
+}
+
+// Write new duty cycle
+void nipwm_apply (struct nipwm_data *this, float64 duty)
+{
+   ni_lock_take (&this->lock);
+   nipwm_write (this, duty);
+   ni_watchdog_feed (&this->watchdog);
+   ni_lock_give (&this->lock);
+}
+
+void nipwm_safe (void *data)
+{
+   struct nipwm_data *this = (struct nipwm_data *) data;
+   float64 duty = this->safe_duty;
+
+   // Default safe duty is the idle state
+   if (duty < 0)
+      duty = this->idle_state == DAQmx_Val_High ? NIPWM_MAX_DUTY 
+                                                 : NIPWM_MIN_DUTY;
+   nipwm_write (this, duty);
+}
+
+void nipwm_close (void *data)
+{
+   struct nipwm_data *this = (struct nipwm_data *) data;
+   ni_watchdog_stop (&this->watchdog);
+   ni_lock_take (&this->lock);
+   ni_clear_task (&this->task);
+   ni_lock_give (&this->lock);
+}
+
+void nipwm_func (struct nipwm_data *this,
+                 const struct context_rmcios *context, int id,
+                 enum function_rmcios function,
+                 enum type_rmcios paramtype,
+                 struct combo_rmcios *returnv,
+                 int num_params, const union param_rmcios param)
 {
+   int32 written;
+   ni_lock *held = ni_hold (this != NULL ? &this->lock : NULL);
+
    switch (function)
    {
    case help_rmcios:
       return_string (context, returnv,
-                     "help for niai - NI analog input\r\n"
-                     " create niai newname\r\n"
-                     " setup newname ni_device_channel | terminal\r\n"
-                     "               | term_cfg(RSE NRSE Diff PseudoDiff) \r\n"
-                     "               | minVal maxVal\r\n"
-                     " read newname #read latest analog value \r\n"
-                     " link newname linked_ch #link output to channel \r\n");
+                     "help for nipwm\r\n"
+                     "create nipwm ch_name\r\n"
+                     "setup ch_name frequency device_channel counter_resource"
+                     "              | idle_state\r\n" 
+                     "   #Example: setup pwm1 1000 Dev1 ctr0 0\r\n"
+                     "setup ch_name close #stop and release task\r\n"
+                     "setup ch_name watchdog timeout | safe_duty\r\n"
+                     "   #Write safe_duty (default idle_state) when not\r\n"
+                     "   #written for timeout seconds. timeout 0 disables.\r\n"
+                     "write ch_name duty_cycle\r\n"
+                     "   #set duty and send applied duty to linked channels\r\n"
+                     "read ch_name \r\n"
+                     "read ch_name stats\r\n"
+                     "   #watchdog trips and tripped 1 while in safe state\r\n");
       break;
-   case create_rmcios: 
-      // params: channel_name=0 device_channel=1 
-      // term_cfg(RSE NRSE Diff PseudoDiff)=2 minVal=3 maxVal=4
+
+   case create_rmcios:
       if (num_params < 1)
-      {
-         printf ("Not enough parameters\r\n");
          break;
-      }
       // allocate new data
-      this = (struct niai_data *) malloc (sizeof (struct niai_data));   
-      if (this == NULL) break;
+      this = (struct nipwm_data *) malloc (sizeof (struct nipwm_data)); 
       
-      // create channel
+      // create channel    
       this->id = create_channel_param (context, paramtype, param, 0, 
-                                       (class_rmcios) nidaq_ai_func, this);
-      
-      // Default values: 
-      this->channel_index = 0;
-      this->value = 0;
+                                       (class_rmcios) nipwm_func, this); 
+
+      //default values:
+      this->duty = 0.001;
+      this->frequency = 1000;   // 1khz
+      this->task = 0;
+      this->idle_state = DAQmx_Val_Low;
+      this->safe_duty = -1;
+      ni_lock_init (&this->lock);
+      ni_watchdog_init (&this->watchdog, &this->lock, nipwm_safe, this);
+      ni_register_resource (this, this->id, nipwm_close,
+                            &this->lock);
       break;
 
    case setup_rmcios:
-      if (this == NULL) break;
-      if (num_params < 2)
+      if (this == NULL)
          break;
+      if (ni_is_command (context, paramtype, param, num_params, "close"))
       {
-         int i;
-         char term_str[30], term_cfg_str[15];
+         nipwm_close (this);
+         break;
+      }
+      if (ni_is_command (context, paramtype, param, num_params, "watchdog"))
+      {
+         if (num_params >= 3)
+            this->safe_duty = param_to_float (context, paramtype, param, 2);
+         if (num_params >= 2)
+            ni_watchdog_start (&this->watchdog, 
+                               param_to_float (context, paramtype, param, 1));
+         break;
+      }
+      if (num_params < 3)
+         break;
 
-         // Get the NI device for given channel:
-         struct ni_device_data *device =
-            get_ni_device_for_channel (param_to_int
-                                       (context, paramtype, param, 0));
-         if (device == NULL)
-         {
-            printf ("NO NI device channel: %s\r\n",
-                    param_to_string (context, paramtype, param, 1, 0, NULL));
-            break;
-         }
-         
-         // link NIAI device analog output data to this channel.
-         link_channel (context, param_to_int (context, paramtype, param, 0), 
-                       this->id); 
+      this->frequency = param_to_float (context, paramtype, param, 0);
 
+      // Get the NI device for given channel:
+      struct ni_device_data *device =
+         get_ni_device_for_channel (param_to_int
+                                    (context, paramtype, param, 1));
+      if (device == NULL)
+      {
+         printf ("No NI device channel: %s\r\n",
+                 param_to_string (context, paramtype, param, 1, 0, NULL));
+         break;
+      }
+      else
+      {
          // Build physical channel string:
-         param_to_string (context, paramtype, param, 1,
-                          sizeof (term_str), term_str);
+         char ctr_str[30];
+         param_to_string (context, paramtype, param, 2,
+                          sizeof (ctr_str), ctr_str);
 
-         char physicalChannel[strlen (term_str) + strlen (device->name) + 3];
+         char physicalChannel[strlen (ctr_str) + strlen (device->name) + 3];
          strcpy (physicalChannel, device->name);
          strcat (physicalChannel, "/");
-         strcat (physicalChannel, term_str);
+         strcat (physicalChannel, ctr_str);
 
-         int term_cfg = DAQmx_Val_Cfg_Default;
-         if (num_params >= 3)
+         if (num_params >= 4)
          {
-            param_to_string (context, paramtype, param, 2,
-                             sizeof (term_cfg_str), term_cfg_str);
-            if (strcmp (term_cfg_str, "RSE") == 0)
-               term_cfg = DAQmx_Val_RSE;
-            if (strcmp (term_cfg_str, "NRSE") == 0)
-               term_cfg = DAQmx_Val_NRSE;
-            if (strcmp (term_cfg_str, "Diff") == 0)
-               term_cfg = DAQmx_Val_Diff;
-            if (strcmp (term_cfg_str, "PseudoDiff") == 0)
-               term_cfg = DAQmx_Val_PseudoDiff;
+            int idle = param_to_int (context, paramtype, param, 3);
+            this->idle_state = DAQmx_Val_Low;
+            this->duty = 0.001;
+            if (idle == 1)
+            {
+               this->duty = 0.999;
+               this->idle_state = DAQmx_Val_High;
+            }
          }
-         float64 minVal = -10.0, maxVal = 10.0;
 
-         if (num_params >= 5)
+         if (this->task != 0)
          {
-            minVal = param_to_float (context, paramtype, param, 3);
-            maxVal = param_to_float (context, paramtype, param, 4);
+            DAQmxErrChk (
+                  DAQmxWriteCtrFreq (this->task, //(TaskHandle taskHandle, 
+                                     1,  //int32 numSampsPerChan, 
+                                     0,  //bool32 autoStart, 
+                                     1.0, //float64 timeout,
+                                     DAQmx_Val_GroupByChannel, // dataLayout, 
+                                     &(this->frequency), // float64 frequency[],
+                                     &(this->duty), //  float64 dutyCycle[], 
+                                     &written, // int32 *numSampsPerChanWritten,
+                                     NULL)); // bool32 *reserved);
          }
+         if (num_params < 2)
+            break;
 
-         /////////////////////////////////////////
-         // Configure the NI device:
-         /////////////////////////////////////////
-
-         if (device->task != 0)
+         bool32 taskdone;
+         if (this->task != 0)
          {
-            DAQmxStopTask (device->task);
+            DAQmxErrChk (DAQmxStopTask (this->task));   
+            DAQmxErrChk (DAQmxClearTask (this->task));  
+            this->task = 0;
          }
-         DAQmxErrChk (
-            DAQmxCreateAIVoltageChan (device->task, // (TaskHandle taskHandle, 
-                                      physicalChannel,  
-                                      "", //nameToAssignToChannel[], 
-                                      term_cfg, //int32 terminalConfig, 
-                                      minVal, //float64 minVal, 
-                                      maxVal, //float64 maxVal, 
-                                      DAQmx_Val_Volts,  //int32 units, 
-                                      ""));  //const char customScaleName[]);
-
-         this->channel_index = device->channels;
-         device->channels++;
+         DAQmxErrChk (DAQmxCreateTask ("", &this->task));
 
-         DAQmxErrChk (
-            DAQmxCfgSampClkTiming (device->task,      //(TaskHandle taskHandle, 
-                                   "",                //const char source[], 
-                                   device->rate,      //float64 rate, 
-                                   DAQmx_Val_Rising,  //int32 activeEdge, 
-                                   DAQmx_Val_FiniteSamps, //int32 sampleMode, 
-                                   device->samples)); // sampsPerChanToAcquire);
+         DAQmxErrChk 
+              (DAQmxCreateCOPulseChanFreq (this->task, // TaskHandle  
+                                           physicalChannel, // counter[], 
+                                           "",  // nameToAssignToChannel[], 
+                                           DAQmx_Val_Hz, //int32 units, 
+                                           this->idle_state, //int32 idleState,
+                                           0.0,  //float64 initialDelay, 
+                                           this->frequency, //float64 freq, 
+                                           this->duty)); //float64 dutyCycle);
 
-         DAQmxErrChk (DAQmxStartTask (device->task)); //(TaskHandle *taskHandle);
-         return_int (context, returnv, device->channels - 1);
+         DAQmxErrChk (DAQmxCfgImplicitTiming
+                      (this->task, DAQmx_Val_ContSamps, 1000));
+         DAQmxErrChk (DAQmxStartTask (this->task));
       }
-
       break;
 
-   case read_rmcios:
+   case write_rmcios:
       if (this == NULL)
          break;
-      return_float (context, returnv, this->value);
+      if (num_params < 1)
+         break;
+      nipwm_apply (this, param_to_float (context, paramtype, param, 0));
+      write_f (context, linked_channels (context, id), this->duty);
       break;
 
-   case write_rmcios:
+   case read_rmcios:
       if (this == NULL)
          break;
-      if (num_params <= this->channel_index)
+      if (ni_is_command (context, paramtype, param, num_params, "stats"))
+      {
+         ni_watchdog_stats (&this->watchdog, context, returnv);
          break;
-      this->value =
-         param_to_float (context, paramtype, param, this->channel_index);
-      write_f (context, linked_channels (context, id), this->value);
+      }
+      return_float (context, returnv, this->duty);
       break;
    }
+
+   if (held != NULL)
+      ni_lock_give (held);
 }
 
-///////////////////////////////////////////////////////////////////////////
-// Analog output
-///////////////////////////////////////////////////////////////////////////
-struct niao_data
+/////////////////////////////////////////////////////////////////////
+// counter input
+/////////////////////////////////////////////////////////////////////
+struct nicounter_data
 {
+   int id;
    TaskHandle task;
-   float value;
-   float64 minVal;
-   float64 maxVal;
+   uInt32 counts;
+   uInt32 zero;
+   ni_lock lock;                // read and reset is one locked operation
 };
 
-void nidaq_ao_func (struct niao_data *this,
-                    const struct context_rmcios *context, int id,
-                    enum function_rmcios function,
-                    enum type_rmcios paramtype,
-                    struct combo_rmcios *returnv,
-                    int num_params, const union param_rmcios param)
+void nicounter_close (void *data)
+{
+   struct nicounter_data *this = (struct nicounter_data *) data;
+   ni_clear_task (&this->task);
+}
+
+void nicounter_func (struct nicounter_data *this,
+                     const struct context_rmcios *context, int id,
+                     enum function_rmcios function,
+                     enum type_rmcios paramtype,
+                     struct combo_rmcios *returnv,
+                     int num_params, const union param_rmcios param)
 {
+   ni_lock *held = ni_hold (this != NULL ? &this->lock : NULL);
+
    switch (function)
    {
    case help_rmcios:
       return_string (context, returnv,
-                     "help for niao.\r\n"
-                     " create niao newname\r\n"
-                     " setup newname device_channel terminal | minVal maxVal\r\n"
-                     " write newname value\r\n");
+                     "help for nicounter.\r\n"
+                     "create nicounter ch_name\r\n"
+                     "setup ch_name device_channel counter | terminal\r\n"
+                     "setup ch_name close #stop and release task\r\n"
+                     "read counter\r\n "
+                     "write counter\r\n "
+                     "  #read and reset\r\n"
+                     "  #sends value before reset to linked channels\r\n");
       break;
 
-   case create_rmcios:
+   case create_rmcios: 
       if (num_params < 1)
          break;
+      
+      // Allocate new data:
+      this = (struct nicounter_data *) malloc (sizeof (struct nicounter_data));
 
-      // allocate new data
-      this = (struct niao_data *) malloc (sizeof (struct niao_data));   
-      // create channel       
-      create_channel_param (context, paramtype, param, 0, 
-                            (class_rmcios) nidaq_ao_func, this);  
-
-      //default values:
+      // Set default values:
       this->task = 0;
-      this->value = 0;
-      this->minVal = -10.0;
-      this->maxVal = 10.0;
+      this->counts = 0;
+      this->zero = 0;
+      ni_lock_init (&this->lock);
+
+      // Create the channel
+      this->id = create_channel_param (context, paramtype, param, 0,
+                                       (class_rmcios) nicounter_func, this);
+      ni_register_resource (this, this->id, nicounter_close,
+                            &this->lock);
       break;
 
    case setup_rmcios:
       if (this == NULL)
          break;
-      if (num_params < 2)
+      if (num_params < 1)
          break;
-      if (num_params >= 4)
+      if (ni_is_command (context, paramtype, param, num_params, "close"))
       {
-         this->minVal = param_to_float (context, paramtype, param, 2);
-         this->maxVal = param_to_float (context, paramtype, param, 3);
+         nicounter_close (this);
+         break;
       }
 
-      if (this->task != 0)
-      {
-         DAQmxErrChk (DAQmxStopTask (this->task));  //(TaskHandle taskHandle);
-         DAQmxErrChk (DAQmxClearTask (this->task)); //(TaskHandle taskHandle);
-         this->task = 0;
-      }
+      this->counts = 0;
+      this->zero = 0;
 
       // Get the NI device for given channel:
       struct ni_device_data *device =
@@ -441,127 +3077,195 @@ void nidaq_ao_func (struct niao_data *this,
                                     (context, paramtype, param, 0));
       if (device == NULL)
       {
-         printf ("NO NI device channel: %s\r\n",
-                 param_to_string (context, paramtype, param, 0, 0, NULL));
+         printf ("No NI device channel: %s\r\n",
+                 param_to_string (context, paramtype, param, 1, 0, NULL));
          break;
       }
       else
       {
          // Build physical channel string:
-         char term_str[20];
+         char ctr_str[30];
          param_to_string (context, paramtype, param, 1,
-                          sizeof (term_str), term_str);
+                          sizeof (ctr_str), ctr_str);
 
-         char physicalChannel[strlen (term_str) + strlen (device->name) + 3];
+         char physicalChannel[strlen (ctr_str) + strlen (device->name) + 3];
          strcpy (physicalChannel, device->name);
          strcat (physicalChannel, "/");
-         strcat (physicalChannel, term_str);
+         strcat (physicalChannel, ctr_str);
+
+         if (this->task != 0)
+         {
+            DAQmxErrChk (DAQmxStopTask (this->task));  
+            DAQmxErrChk (DAQmxClearTask (this->task));  
+         }
 
-         DAQmxErrChk (DAQmxCreateTask ("", //const char taskName[], 
-                                       &this->task)); //TaskHandle *taskHandle);
+         DAQmxErrChk (DAQmxCreateTask ("", &this->task));
 
          DAQmxErrChk (
-               DAQmxCreateAOVoltageChan (this->task,//(TaskHandle taskHandle, 
-                                         physicalChannel,  
-                                         "", //nameToAssignToChannel[], 
-                                         this->minVal, //float64 minVal, 
-                                         this->maxVal, //float64 maxVal, 
-                                         DAQmx_Val_Volts, //int32 units, 
-                                         "")); //const char customScaleName[]);
+            DAQmxCreateCICountEdgesChan (this->task,  //(TaskHandle 
+                                         physicalChannel, // counter[], 
+                                         "",  // nameToAssignToChannel[], 
+                                         DAQmx_Val_Falling,   //int32 edge, 
+                                         0,   //uInt32 initialCount, 
+                                         DAQmx_Val_CountUp)); //countDirection)
 
+         if (num_params >= 3)
+         {
+            char terminal_str[30];
+            param_to_string (context, paramtype, param, 2, sizeof(terminal_str), terminal_str);
+            DAQmxErrChk ( DAQmxSetCICountEdgesTerm (this->task, physicalChannel, terminal_str));
+         }
          DAQmxErrChk (DAQmxStartTask (this->task));
       }
       break;
 
+   case read_rmcios:
    case write_rmcios:
       if (this == NULL)
          break;
-      if (num_params < 1)
-         break;
-      if (this->task == 0)
-         break;
-
-      this->value = param_to_float (context, paramtype, param, 0);
-
-      DAQmxErrChk (DAQmxWriteAnalogScalarF64 (this->task, // (TaskHandle  
-                                              0,   //bool32 autoStart, 
-                                              0.5, //float64 timeout, 
-                                              this->value,  //float64 value, 
-                                              NULL));   //bool32 *reserved);
+      {
+         uInt32 counts;
+         DAQmxErrChk (DAQmxReadCounterScalarU32 (this->task, //(TaskHandle, 
+                                                 2.0,   //float64 timeout, 
+                                                 &this->counts, //uInt32 *value,
+                                                 NULL)); //bool32 *reserved);
 
-      write_f (context, linked_channels (context, id), this->value);
-      break;
+         counts = this->counts - this->zero;
+         if (function == write_rmcios)
+         {
+            // set counter to 0
+            this->zero = this->counts;    
+         }
 
-   case read_rmcios:
-      if (this == NULL)
-         break;
-      return_float (context, returnv, this->value);
+         return_int (context, returnv, counts);
+         if (function == write_rmcios)
+         {
+            write_f (context, linked_channels (context, id), counts);
+         }
+      }
       break;
    }
+
+   if (held != NULL)
+      ni_lock_give (held);
 }
 
-////////////////////////////////////////////////////////////////////
-// PWM output
-////////////////////////////////////////////////////////////////////
-struct nipwm_data
+struct nido_data
 {
+   int id;
    TaskHandle task;
-   float64 duty;                // 
-   float64 frequency;           // in hz
-   int idle_state;              // 1 or 0 ;
+   uInt8 value;
+   uInt8 safe_value;            // output on missed watchdog deadline
+   ni_lock lock;                // serializes output writes
+   struct ni_watchdog watchdog;
 };
 
-void nipwm_func (struct nipwm_data *this,
-                 const struct context_rmcios *context, int id,
-                 enum function_rmcios function,
-                 enum type_rmcios paramtype,
-                 struct combo_rmcios *returnv,
-                 int num_params, const union param_rmcios param)
+// Write line state to the task. Called with the lock held.
+void nido_write (struct nido_data *this, uInt8 value)
 {
-   int32 written;
+   if (this->task == 0)
+      return;
+   this->value = value;
+   DAQmxErrChk (DAQmxWriteDigitalLines
+                (this->task, 1, 1, 10.0, DAQmx_Val_GroupByChannel,
+                 &this->value, NULL, NULL));
+}
+
+// Write new line state
+void nido_apply (struct nido_data *this, uInt8 value)
+{
+   ni_lock_take (&this->lock);
+   nido_write (this, value);
+   ni_watchdog_feed (&this->watchdog);
+   ni_lock_give (&this->lock);
+}
+
+void nido_safe (void *data)
+{
+   struct nido_data *this = (struct nido_data *) data;
+   nido_write (this, this->safe_value);
+}
+
+void nido_close (void *data)
+{
+   struct nido_data *this = (struct nido_data *) data;
+   ni_watchdog_stop (&this->watchdog);
+   ni_lock_take (&this->lock);
+   ni_clear_task (&this->task);
+   ni_lock_give (&this->lock);
+}
+
+void nido_func (struct nido_data *this,
+                const struct context_rmcios *context, int id,
+                enum function_rmcios function,
+                enum type_rmcios paramtype,
+                struct combo_rmcios *returnv,
+                int num_params, const union param_rmcios param)
+{
+   ni_lock *held = ni_hold (this != NULL ? &this->lock : NULL);
+
    switch (function)
    {
    case help_rmcios:
       return_string (context, returnv,
-                     "help for nipwm\r\n"
-                     "create nipwm ch_name\r\n"
-                     "setup ch_name frequency device_channel counter_resource"
-                     "              | idle_state\r\n" 
-                     "   #Example: setup pwm1 1000 Dev1 ctr0 0\r\n"
-                     "write ch_name duty_cycle\r\n"
-                     "   #set duty and send applied duty to linked channels\r\n"
-                     "read ch_name \r\n");
+                     "help for nido.\r\n"
+                     "create nido newname\r\n"
+                     "setup newname device_channel port line\r\n"
+                     "setup newname close #stop and release task\r\n"
+                     "setup newname watchdog timeout | safe_value\r\n"
+                     "   #Write safe_value (default 0) when not written\r\n"
+                     "   #for timeout seconds. timeout 0 disables.\r\n"
+                     "write newname value\r\n"
+                     "read newname\r\n"
+                     "read newname stats\r\n"
+                     "   #watchdog trips and tripped 1 while in safe state\r\n"
+                     "example: setup do1 NI1 port0 line1\r\n");
       break;
 
    case create_rmcios:
       if (num_params < 1)
          break;
-      // allocate new data
-      this = (struct nipwm_data *) malloc (sizeof (struct nipwm_data)); 
-      
-      // create channel    
-      create_channel_param (context, paramtype, param, 0, 
-                            (class_rmcios) nipwm_func, this); 
+      // Allocate new data:
+      this = (struct nido_data *) malloc (sizeof (struct nido_data));
 
-      //default values:
-      this->duty = 0.001;
-      this->frequency = 1000;   // 1khz
+      // Set default values:
       this->task = 0;
-      this->idle_state = DAQmx_Val_Low;
+      this->value = 0;
+      this->safe_value = 0;
+      ni_lock_init (&this->lock);
+      ni_watchdog_init (&this->watchdog, &this->lock, nido_safe, this);
+
+      // Create the channel
+      this->id = create_channel_param (context, paramtype, param, 0,
+                                       (class_rmcios) nido_func, this);
+      ni_register_resource (this, this->id, nido_close,
+                            &this->lock);
       break;
 
    case setup_rmcios:
       if (this == NULL)
          break;
+      if (ni_is_command (context, paramtype, param, num_params, "close"))
+      {
+         nido_close (this);
+         break;
+      }
+      if (ni_is_command (context, paramtype, param, num_params, "watchdog"))
+      {
+         if (num_params >= 3)
+            this->safe_value = param_to_int (context, paramtype, param, 2);
+         if (num_params >= 2)
+            ni_watchdog_start (&this->watchdog, 
+                               param_to_float (context, paramtype, param, 1));
+         break;
+      }
       if (num_params < 3)
          break;
 
-      this->frequency = param_to_float (context, paramtype, param, 0);
-
       // Get the NI device for given channel:
       struct ni_device_data *device =
          get_ni_device_for_channel (param_to_int
-                                    (context, paramtype, param, 1));
+                                    (context, paramtype, param, 0));
       if (device == NULL)
       {
          printf ("No NI device channel: %s\r\n",
@@ -571,65 +3275,33 @@ void nipwm_func (struct nipwm_data *this,
       else
       {
          // Build physical channel string:
-         char ctr_str[30];
+         char port_str[30];
+         char line_str[30];
+         param_to_string (context, paramtype, param, 1,
+                          sizeof (port_str), port_str);
          param_to_string (context, paramtype, param, 2,
-                          sizeof (ctr_str), ctr_str);
+                          sizeof (line_str), line_str);
 
-         char physicalChannel[strlen (ctr_str) + strlen (device->name) + 3];
+         char physicalChannel[strlen (device->name) +
+                              strlen (port_str) + strlen (line_str) + 4];
          strcpy (physicalChannel, device->name);
          strcat (physicalChannel, "/");
-         strcat (physicalChannel, ctr_str);
-
-         if (num_params >= 4)
-         {
-            int idle = param_to_int (context, paramtype, param, 3);
-            this->idle_state = DAQmx_Val_Low;
-            this->duty = 0.001;
-            if (idle == 1)
-            {
-               this->duty = 0.999;
-               this->idle_state = DAQmx_Val_High;
-            }
-         }
-
-         if (this->task != 0)
-         {
-            DAQmxErrChk (
-                  DAQmxWriteCtrFreq (this->task, //(TaskHandle taskHandle, 
-                                     1,  //int32 numSampsPerChan, 
-                                     0,  //bool32 autoStart, 
-                                     1.0, //float64 timeout,
-                                     DAQmx_Val_GroupByChannel, // dataLayout, 
-                                     &(this->frequency), // float64 frequency[],
-                                     &(this->duty), //  float64 dutyCycle[], 
-                                     &written, // int32 *numSampsPerChanWritten,
-                                     NULL)); // bool32 *reserved);
-         }
-         if (num_params < 2)
-            break;
+         strcat (physicalChannel, port_str);
+         strcat (physicalChannel, "/");
+         strcat (physicalChannel, line_str);
 
-         bool32 taskdone;
          if (this->task != 0)
-         {
+         {  
             DAQmxErrChk (DAQmxStopTask (this->task));   
             DAQmxErrChk (DAQmxClearTask (this->task));  
-            this->task = 0;
          }
-         DAQmxErrChk (DAQmxCreateTask ("", &this->task));
-
-         DAQmxErrChk 
-              (DAQmxCreateCOPulseChanFreq (this->task, // TaskHandle  
-                                           physicalChannel, // counter[], 
-                                           "",  // nameToAssignToChannel[], 
-                                           DAQmx_Val_Hz, //int32 units, 
-                                           this->idle_state, //int32 idleState,
-                                           0.0,  //float64 initialDelay, 
-                                           this->frequency, //float64 freq, 
-                                           this->duty)); //float64 dutyCycle);
 
-         DAQmxErrChk (DAQmxCfgImplicitTiming
-                      (this->task, DAQmx_Val_ContSamps, 1000));
+         DAQmxErrChk (DAQmxCreateTask ("", &this->task));
+         DAQmxErrChk (DAQmxCreateDOChan (this->task,
+                                         physicalChannel,
+                                         "", DAQmx_Val_ChanPerLine));
          DAQmxErrChk (DAQmxStartTask (this->task));
+
       }
       break;
 
@@ -638,262 +3310,797 @@ void nipwm_func (struct nipwm_data *this,
          break;
       if (num_params < 1)
          break;
-      this->duty = param_to_float (context, paramtype, param, 0);
-      if (this->duty > 0.999)
-         this->duty = 0.999;
-      if (this->duty < 0.001)
-         this->duty = 0.001;
-
-      DAQmxErrChk (DAQmxWriteCtrFreq (this->task, //(TaskHandle taskHandle, 
-                                      1,        //int32 numSampsPerChan, 
-                                      0,        //bool32 autoStart, 
-                                      1.0,      //float64 timeout,
-                                      DAQmx_Val_GroupByChannel, // dataLayout, 
-                                      &(this->frequency), // float64 frequency[],
-                                      &(this->duty),    //  float64 dutyCycle[], 
-                                      &written, // *numSampsPerChanWritten,
-                                      NULL));   // bool32 *reserved);
-
-      write_f (context, linked_channels (context, id), this->duty);
+      nido_apply (this, param_to_int (context, paramtype, param, 0));
       break;
 
    case read_rmcios:
       if (this == NULL)
          break;
-      return_float (context, returnv, this->duty);
+      if (ni_is_command (context, paramtype, param, num_params, "stats"))
+      {
+         ni_watchdog_stats (&this->watchdog, context, returnv);
+         break;
+      }
+      return_int (context, returnv, this->value);
       break;
    }
+
+   if (held != NULL)
+      ni_lock_give (held);
 }
 
 /////////////////////////////////////////////////////////////////////
-// counter input
+// PID controller from analog input to analog or pulse output
 /////////////////////////////////////////////////////////////////////
-struct nicounter_data
+struct nipid_data
 {
-   TaskHandle task;
-   uInt32 counts;
-   uInt32 zero;
+   int id;
+   struct niai_data *input;
+   struct niao_data *ao;        // output, when output is niao
+   struct nipwm_data *pwm;      // output, when output is nipwm
+   float64 kp, ki, kd;
+   float64 setpoint;
+   float64 integral;            // integral term in output units
+   float64 last_error;
+   int has_last;
+   float64 output;
+   float64 period;              // block period of the input, seconds
+   float64 last_time;           // time of previous control step
+   float64 interval;            // measured time between control steps
+   float64 exec_time;           // time to compute and write the output
 };
 
-void nicounter_func (struct nicounter_data *this,
-                     const struct context_rmcios *context, int id,
-                     enum function_rmcios function,
-                     enum type_rmcios paramtype,
-                     struct combo_rmcios *returnv,
-                     int num_params, const union param_rmcios param)
+// Control step run inside the device acquisition on every input block
+void nipid_block (void *data, const struct context_rmcios *context,
+                  float64 value, const float64 *samples, int n, float64 rate)
+{
+   struct nipid_data *this = (struct nipid_data *) data;
+   float64 start = ni_time ();
+   float64 min, max;
+   float64 error, derivative, integral, output;
+
+   // Output limits of the controlled channel
+   if (this->ao != NULL)
+   {
+      min = this->ao->minVal;
+      max = this->ao->maxVal;
+   }
+   else if (this->pwm != NULL)
+   {
+      min = NIPWM_MIN_DUTY;
+      max = NIPWM_MAX_DUTY;
+   }
+   else
+      return;
+
+   // Hardware clock gives the step time
+   this->period = n / rate;
+   error = ni_load_f64 (&this->setpoint) - value;
+   derivative = 0;
+   if (this->has_last)
+      derivative = (error - this->last_error) / this->period;
+   this->last_error = error;
+   this->has_last = 1;
+
+   integral = this->integral + this->ki * error * this->period;
+   output = this->kp * error + integral + this->kd * derivative;
+
+   // Clamp output. Integrate only when it does not drive further into limit.
+   if (output > max)
+   {
+      output = max;
+      if (error * this->ki < 0)
+         this->integral = integral;
+   }
+   else if (output < min)
+   {
+      output = min;
+      if (error * this->ki > 0)
+         this->integral = integral;
+   }
+   else
+      this->integral = integral;
+
+   if (this->integral > max)
+      this->integral = max;
+   if (this->integral < min)
+      this->integral = min;
+
+   ni_store_f64 (&this->output, output);
+   if (this->ao != NULL)
+      niao_apply (this->ao, output);
+   else
+      nipwm_apply (this->pwm, output);
+
+   write_f (context, linked_channels (context, this->id), output);
+
+   if (this->last_time > 0)
+      this->interval = start - this->last_time;
+   this->last_time = start;
+   this->exec_time = ni_time () - start;
+}
+
+void nipid_close (void *data)
+{
+   struct nipid_data *this = (struct nipid_data *) data;
+   struct niai_data *input = this->input;
+   if (input != NULL)
+   {
+      // Hooks are walked by the acquisition thread of the device
+      struct ni_device_data *device = input->device;
+      if (device != NULL)
+         ni_lock_take (&device->lock);
+      ni_hook_remove (&input->hooks, this);
+      if (device != NULL)
+         ni_lock_give (&device->lock);
+   }
+   this->input = NULL;
+   this->ao = NULL;
+   this->pwm = NULL;
+}
+
+void nipid_func (struct nipid_data *this,
+                 const struct context_rmcios *context, int id,
+                 enum function_rmcios function,
+                 enum type_rmcios paramtype,
+                 struct combo_rmcios *returnv,
+                 int num_params, const union param_rmcios param)
 {
    switch (function)
    {
    case help_rmcios:
       return_string (context, returnv,
-                     "help for nicounter.\r\n"
-                     "create nicounter ch_name\r\n"
-                     "setup ch_name device_channel counter | terminal\r\n"
-                     "read counter\r\n "
-                     "write counter\r\n "
-                     "  #read and reset\r\n"
-                     "  #sends value before reset to linked channels\r\n");
+                     "help for nipid - PID loop from niai to niao or nipwm\r\n"
+                     "create nipid newname\r\n"
+                     "setup newname niai_channel output_channel kp ki kd"
+                     " | setpoint\r\n"
+                     "   #Runs on every acquired block of the niai device.\r\n"
+                     "   #Output is limited to niao minVal..maxVal or \r\n"
+                     "   #nipwm duty limits. Use continuous nidev for\r\n"
+                     "   #hardware timed loop rate.\r\n"
+                     "setup newname close #stop the loop\r\n"
+                     "write newname setpoint\r\n"
+                     "read newname #read latest output\r\n"
+                     "read newname stats\r\n"
+                     "   #read block period, step interval and execution time\r\n");
       break;
 
-   case create_rmcios: 
+   case create_rmcios:
       if (num_params < 1)
          break;
-      
       // Allocate new data:
-      this = (struct nicounter_data *) malloc (sizeof (struct nicounter_data));
+      this = (struct nipid_data *) malloc (sizeof (struct nipid_data));
+      if (this == NULL)
+         break;
+
+      // Set default values:
+      this->input = NULL;
+      this->ao = NULL;
+      this->pwm = NULL;
+      this->kp = 1;
+      this->ki = 0;
+      this->kd = 0;
+      this->setpoint = 0;
+      this->integral = 0;
+      this->last_error = 0;
+      this->has_last = 0;
+      this->output = 0;
+      this->period = 0;
+      this->last_time = 0;
+      this->interval = 0;
+      this->exec_time = 0;
+
+      // Create the channel
+      this->id = create_channel_param (context, paramtype, param, 0,
+                                       (class_rmcios) nipid_func, this);
+      ni_register_resource (this, this->id, nipid_close, NULL);
+      break;
+
+   case setup_rmcios:
+      if (this == NULL)
+         break;
+      if (ni_is_command (context, paramtype, param, num_params, "close"))
+      {
+         nipid_close (this);
+         break;
+      }
+      if (num_params < 5)
+         break;
+      {
+         int input_id = param_to_int (context, paramtype, param, 0);
+         int output_id = param_to_int (context, paramtype, param, 1);
+         struct niai_data *input = ni_find_resource (input_id, niai_close);
+         struct niao_data *ao = ni_find_resource (output_id, niao_close);
+         struct nipwm_data *pwm = ni_find_resource (output_id, nipwm_close);
 
-      // Set default values:
-      this->task = 0;
-      this->counts = 0;
-      this->zero = 0;
+         if (input == NULL)
+         {
+            printf ("No niai channel for PID input\r\n");
+            break;
+         }
+         if (ao == NULL && pwm == NULL)
+         {
+            printf ("No niao or nipwm channel for PID output\r\n");
+            break;
+         }
 
-      // Create the channel
-      create_channel_param (context, paramtype, param, 0,
-                            (class_rmcios) nicounter_func, this);
+         nipid_close (this);
+         this->kp = param_to_float (context, paramtype, param, 2);
+         this->ki = param_to_float (context, paramtype, param, 3);
+         this->kd = param_to_float (context, paramtype, param, 4);
+         if (num_params >= 6)
+            this->setpoint = param_to_float (context, paramtype, param, 5);
+         this->integral = 0;
+         this->has_last = 0;
+         this->last_time = 0;
+         this->input = input;
+         this->ao = ao;
+         this->pwm = pwm;
+         if (input->device != NULL)
+            ni_lock_take (&input->device->lock);
+         ni_hook_add (&input->hooks, nipid_block, this);
+         if (input->device != NULL)
+            ni_lock_give (&input->device->lock);
+      }
       break;
 
-   case setup_rmcios:
+   case write_rmcios:
       if (this == NULL)
          break;
       if (num_params < 1)
          break;
+      ni_store_f64 (&this->setpoint, 
+                    param_to_float (context, paramtype, param, 0));
+      break;
 
-      this->counts = 0;
-      this->zero = 0;
-
-      // Get the NI device for given channel:
-      struct ni_device_data *device =
-         get_ni_device_for_channel (param_to_int
-                                    (context, paramtype, param, 0));
-      if (device == NULL)
+   case read_rmcios:
+      if (this == NULL)
+         break;
+      if (ni_is_command (context, paramtype, param, num_params, "stats"))
       {
-         printf ("No NI device channel: %s\r\n",
-                 param_to_string (context, paramtype, param, 1, 0, NULL));
+         return_string (context, returnv, "period_us ");
+         return_float (context, returnv, this->period * 1e6);
+         return_string (context, returnv, " interval_us ");
+         return_float (context, returnv, this->interval * 1e6);
+         return_string (context, returnv, " exec_us ");
+         return_float (context, returnv, this->exec_time * 1e6);
          break;
       }
-      else
+      return_float (context, returnv, ni_load_f64 (&this->output));
+      break;
+   }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Spectral analysis of analog input blocks
+/////////////////////////////////////////////////////////////////////
+#define NI_PI 3.14159265358979323846
+
+// Maximum number of frequency bands of nifft
+#define NIFFT_MAX_BANDS 32
+
+// Real FFT plan of n points with Hann window. Plans are shared by all
+// nifft channels with the same segment length and kept until unload.
+struct ni_fft_plan
+{
+   int n;
+   int *rev;                  // bit reversal of n/2 point complex FFT
+   float64 *tw_re, *tw_im;    // twiddles of each stage, contiguous per stage
+   float64 *post_re, *post_im;// twiddles to split n/2 complex to n real
+   float64 *window;           // Hann window
+   float64 window_power;      // sum of squared window
+   struct ni_fft_plan *next;
+};
+
+struct ni_fft_plan *first_ni_fft_plan = NULL;
+
+// Find or create plan for n points. n must be power of two.
+struct ni_fft_plan *ni_fft_plan_get (int n)
+{
+   struct ni_fft_plan *plan;
+   int m = n / 2;
+   int i, bits, len;
+
+   for (plan = first_ni_fft_plan; plan != NULL; plan = plan->next)
+   {
+      if (plan->n == n)
+         return plan;
+   }
+
+   plan = (struct ni_fft_plan *) malloc (sizeof (struct ni_fft_plan));
+   if (plan == NULL)
+      return NULL;
+   plan->n = n;
+   plan->rev = (int *) malloc (sizeof (int) * m);
+   plan->tw_re = (float64 *) malloc (sizeof (float64) * m);
+   plan->tw_im = (float64 *) malloc (sizeof (float64) * m);
+   plan->post_re = (float64 *) malloc (sizeof (float64) * m);
+   plan->post_im = (float64 *) malloc (sizeof (float64) * m);
+   plan->window = (float64 *) malloc (sizeof (float64) * n);
+   if (plan->rev == NULL || plan->tw_re == NULL || plan->tw_im == NULL
+       || plan->post_re == NULL || plan->post_im == NULL 
+       || plan->window == NULL)
+   {
+      free (plan->rev);
+      free (plan->tw_re);
+      free (plan->tw_im);
+      free (plan->post_re);
+      free (plan->post_im);
+      free (plan->window);
+      free (plan);
+      return NULL;
+   }
+
+   for (bits = 0; (1 << bits) < m; bits++);
+   for (i = 0; i < m; i++)
+   {
+      int b, r = 0;
+      for (b = 0; b < bits; b++)
+         r |= ((i >> b) & 1) << (bits - 1 - b);
+      plan->rev[i] = r;
+   }
+
+   // Stage with butterfly span len uses twiddles at len/2-1 ... len-2
+   for (len = 2; len <= m; len <<= 1)
+   {
+      for (i = 0; i < len / 2; i++)
       {
-         // Build physical channel string:
-         char ctr_str[30];
-         param_to_string (context, paramtype, param, 1,
-                          sizeof (ctr_str), ctr_str);
+         plan->tw_re[len / 2 - 1 + i] = cos (2 * NI_PI * i / len);
+         plan->tw_im[len / 2 - 1 + i] = -sin (2 * NI_PI * i / len);
+      }
+   }
 
-         char physicalChannel[strlen (ctr_str) + strlen (device->name) + 3];
-         strcpy (physicalChannel, device->name);
-         strcat (physicalChannel, "/");
-         strcat (physicalChannel, ctr_str);
+   for (i = 0; i < m; i++)
+   {
+      plan->post_re[i] = cos (2 * NI_PI * i / n);
+      plan->post_im[i] = -sin (2 * NI_PI * i / n);
+   }
 
-         if (this->task != 0)
+   plan->window_power = 0;
+   for (i = 0; i < n; i++)
+   {
+      plan->window[i] = 0.5 - 0.5 * cos (2 * NI_PI * i / n);
+      plan->window_power += plan->window[i] * plan->window[i];
+   }
+
+   plan->next = first_ni_fft_plan;
+   first_ni_fft_plan = plan;
+   return plan;
+}
+
+void ni_fft_plans_free (void)
+{
+   while (first_ni_fft_plan != NULL)
+   {
+      struct ni_fft_plan *plan = first_ni_fft_plan;
+      first_ni_fft_plan = plan->next;
+      free (plan->rev);
+      free (plan->tw_re);
+      free (plan->tw_im);
+      free (plan->post_re);
+      free (plan->post_im);
+      free (plan->window);
+      free (plan);
+   }
+}
+
+// Windowed power spectrum of n real samples. Samples are packed to n/2
+// complex points, transformed in split real/imaginary arrays and split 
+// back to n/2+1 real spectrum bins. Inner loops are free of dependencies 
+// between iterations so the compiler can vectorize them.
+// re and im are work arrays of n/2 points. power has n/2+1 points.
+void ni_fft_power (const struct ni_fft_plan *plan, const float64 *x,
+                   float64 *re, float64 *im, float64 *power)
+{
+   int m = plan->n / 2;
+   int i, k, len;
+
+   for (i = 0; i < m; i++)
+   {
+      int r = plan->rev[i];
+      re[r] = x[2 * i] * plan->window[2 * i];
+      im[r] = x[2 * i + 1] * plan->window[2 * i + 1];
+   }
+
+   for (len = 2; len <= m; len <<= 1)
+   {
+      int half = len / 2;
+      const float64 *wr = plan->tw_re + half - 1;
+      const float64 *wi = plan->tw_im + half - 1;
+      for (i = 0; i < m; i += len)
+      {
+         float64 *ar = re + i, *ai = im + i;
+         float64 *br = re + i + half, *bi = im + i + half;
+         for (k = 0; k < half; k++)
          {
-            DAQmxErrChk (DAQmxStopTask (this->task));  
-            DAQmxErrChk (DAQmxClearTask (this->task));  
+            float64 tr = br[k] * wr[k] - bi[k] * wi[k];
+            float64 ti = br[k] * wi[k] + bi[k] * wr[k];
+            br[k] = ar[k] - tr;
+            bi[k] = ai[k] - ti;
+            ar[k] += tr;
+            ai[k] += ti;
          }
+      }
+   }
 
-         DAQmxErrChk (DAQmxCreateTask ("", &this->task));
+   power[0] = (re[0] + im[0]) * (re[0] + im[0]);
+   power[m] = (re[0] - im[0]) * (re[0] - im[0]);
+   for (k = 1; k < m; k++)
+   {
+      float64 er = (re[k] + re[m - k]) * 0.5;
+      float64 ei = (im[k] - im[m - k]) * 0.5;
+      float64 odr = (im[k] + im[m - k]) * 0.5;
+      float64 odi = (re[m - k] - re[k]) * 0.5;
+      float64 xr = er + odr * plan->post_re[k] - odi * plan->post_im[k];
+      float64 xi = ei + odi * plan->post_re[k] + odr * plan->post_im[k];
+      power[k] = xr * xr + xi * xi;
+   }
+}
 
-         DAQmxErrChk (
-            DAQmxCreateCICountEdgesChan (this->task,  //(TaskHandle 
-                                         physicalChannel, // counter[], 
-                                         "",  // nameToAssignToChannel[], 
-                                         DAQmx_Val_Falling,   //int32 edge, 
-                                         0,   //uInt32 initialCount, 
-                                         DAQmx_Val_CountUp)); //countDirection)
+// Welch spectrum of an analog input
+struct nifft_data
+{
+   int id;
+   struct niai_data *input;
+   struct ni_fft_plan *plan;
+   int overlap;               // samples shared by consecutive segments
+   int averages;              // segments averaged per result
+   float64 *segment;          // samples of the segment being collected
+   int fill;                  // samples in segment
+   float64 *re, *im;          // FFT work arrays
+   float64 *power;            // power of the latest segment
+   float64 *psd;              // sum of segment powers
+   int segments;              // segments in psd
+   float64 rate;              // sample rate of the collected segments
+   int bands;                 // number of bands. 0=peak frequency
+   float64 edges[NIFFT_MAX_BANDS + 1]; // band edges in Hz
+   uInt32 results_seq;        // odd while results are being updated
+   float results[NIFFT_MAX_BANDS];     // latest band powers or peak
+   int num_results;
+   uInt64 spectra;            // number of results
+   float64 exec_time;         // time to compute latest result
+};
 
-         if (num_params >= 3)
+// Compute the result from averaged segments and send it to linked channels
+void nifft_result (struct nifft_data *this, 
+                   const struct context_rmcios *context)
+{
+   int m = this->plan->n / 2;
+   float64 df = this->rate / this->plan->n;
+   // One sided power spectral density
+   float64 scale = 2.0 / (this->segments * this->rate 
+                          * this->plan->window_power);
+   int k, b;
+
+   for (k = 0; k <= m; k++)
+      this->psd[k] *= scale;
+   this->psd[0] *= 0.5;
+   this->psd[m] *= 0.5;
+
+   ni_seq_write_begin (&this->results_seq);
+   if (this->bands > 0)
+   {
+      // Power in each band [edge_b, edge_b+1)
+      for (b = 0; b < this->bands; b++)
+      {
+         float64 sum = 0;
+         for (k = 0; k <= m; k++)
          {
-            char terminal_str[30];
-            param_to_string (context, paramtype, param, 2, sizeof(terminal_str), terminal_str);
-            DAQmxErrChk ( DAQmxSetCICountEdgesTerm (this->task, physicalChannel, terminal_str));
+            float64 f = k * df;
+            if (f >= this->edges[b] && f < this->edges[b + 1])
+               sum += this->psd[k];
          }
-         DAQmxErrChk (DAQmxStartTask (this->task));
+         this->results[b] = sum * df;
       }
-      break;
+      this->num_results = this->bands;
+   }
+   else
+   {
+      // Largest peak above DC. Frequency refined by parabola through 
+      // neighbour bins.
+      int peak = 1;
+      float64 offset = 0;
+      float64 sum = 0;
+      for (k = 2; k < m; k++)
+      {
+         if (this->psd[k] > this->psd[peak])
+            peak = k;
+      }
+      if (peak > 0 && peak < m)
+      {
+         float64 a = this->psd[peak - 1];
+         float64 c = this->psd[peak + 1];
+         float64 d = a - 2 * this->psd[peak] + c;
+         if (d != 0)
+            offset = 0.5 * (a - c) / d;
+      }
+      // Power of the peak is summed over main lobe of the Hann window
+      for (k = peak - 2; k <= peak + 2; k++)
+      {
+         if (k >= 0 && k <= m)
+            sum += this->psd[k];
+      }
+      this->results[0] = (peak + offset) * df;
+      this->results[1] = sum * df;
+      this->num_results = 2;
+   }
+   this->spectra++;
+   ni_seq_write_end (&this->results_seq);
 
-   case read_rmcios:
-   case write_rmcios:
-      if (this == NULL)
+   run_channel (context, linked_channels (context, this->id),
+                write_rmcios, float_rmcios, 0, this->num_results,
+                (const union param_rmcios) this->results);
+}
+
+// Collect samples of every input block into overlapping segments
+void nifft_block (void *data, const struct context_rmcios *context,
+                  float64 value, const float64 *samples, int n, float64 rate)
+{
+   struct nifft_data *this = (struct nifft_data *) data;
+   int size = this->plan->n;
+   int step = size - this->overlap;
+   int i, k;
+
+   // Segments of different rate are not averaged together
+   if (rate != this->rate)
+   {
+      this->rate = rate;
+      this->fill = 0;
+      this->segments = 0;
+   }
+
+   for (i = 0; i < n;)
+   {
+      int count = size - this->fill;
+      if (count > n - i)
+         count = n - i;
+      memcpy (this->segment + this->fill, samples + i, 
+              sizeof (float64) * count);
+      this->fill += count;
+      i += count;
+      if (this->fill < size)
          break;
-      DAQmxErrChk (DAQmxReadCounterScalarU32 (this->task, //(TaskHandle, 
-                                              2.0,      //float64 timeout, 
-                                              &this->counts, //uInt32 *value, 
-                                              NULL));   //bool32 *reserved);
 
-      return_int (context, returnv, this->counts - this->zero);
-      if (function == write_rmcios)
+      float64 start = ni_time ();
+      ni_fft_power (this->plan, this->segment, this->re, this->im, 
+                    this->power);
+      if (this->segments == 0)
+         memcpy (this->psd, this->power, sizeof (float64) * (size / 2 + 1));
+      else
       {
-         write_f (context, linked_channels (context, id),
-                  (this->counts - this->zero));
-         // set counter to 0
-         this->zero = this->counts;    
+         for (k = 0; k <= size / 2; k++)
+            this->psd[k] += this->power[k];
       }
-      break;
+      this->segments++;
+
+      memmove (this->segment, this->segment + step, 
+               sizeof (float64) * this->overlap);
+      this->fill = this->overlap;
+
+      if (this->segments >= this->averages)
+      {
+         nifft_result (this, context);
+         this->segments = 0;
+      }
+      ni_store_f64 (&this->exec_time, ni_time () - start);
    }
 }
 
-struct nido_data
+// Detach from analog input and release buffers
+void nifft_close (void *data)
 {
-   TaskHandle task;
-   uInt8 value;
-};
+   struct nifft_data *this = (struct nifft_data *) data;
+   struct niai_data *input = this->input;
+   if (input != NULL)
+   {
+      // Hooks are walked by the acquisition thread of the device
+      struct ni_device_data *device = input->device;
+      if (device != NULL)
+         ni_lock_take (&device->lock);
+      ni_hook_remove (&input->hooks, this);
+      if (device != NULL)
+         ni_lock_give (&device->lock);
+   }
+   this->input = NULL;
+   free (this->segment);
+   free (this->re);
+   free (this->im);
+   free (this->power);
+   free (this->psd);
+   this->segment = NULL;
+   this->re = NULL;
+   this->im = NULL;
+   this->power = NULL;
+   this->psd = NULL;
+}
 
-void nido_func (struct nido_data *this,
-                const struct context_rmcios *context, int id,
-                enum function_rmcios function,
-                enum type_rmcios paramtype,
-                struct combo_rmcios *returnv,
-                int num_params, const union param_rmcios param)
+void nifft_func (struct nifft_data *this,
+                 const struct context_rmcios *context, int id,
+                 enum function_rmcios function,
+                 enum type_rmcios paramtype,
+                 struct combo_rmcios *returnv,
+                 int num_params, const union param_rmcios param)
 {
    switch (function)
    {
    case help_rmcios:
       return_string (context, returnv,
-                     "help for nido.\r\n"
-                     "create nido newname\r\n"
-                     "setup newname device_channel port line\r\n"
-                     "write newname value\r\n"
-                     "read newname\r\n"
-                     "example: setup do1 NI1 port0 line1\r\n");
+                     "help for nifft - Welch power spectrum of niai\r\n"
+                     "create nifft newname\r\n"
+                     "setup newname niai_channel segment | overlap averages\r\n"
+                     "   #segment: samples per FFT, power of two 8..65536\r\n"
+                     "   #overlap: samples shared by segments. Default half\r\n"
+                     "   #averages: segments per result. Default 8\r\n"
+                     "   #Hann window. Computed inside the acquisition \r\n"
+                     "   #of the niai device.\r\n"
+                     "setup newname bands f0 f1 f2 ... #band edges in Hz\r\n"
+                     "   #Send power of each band to linked channels.\r\n"
+                     "setup newname peak\r\n"
+                     "   #Send peak frequency and its power. (default)\r\n"
+                     "setup newname close #stop the analysis\r\n"
+                     "read newname #read latest result\r\n"
+                     "read newname stats\r\n"
+                     "   #read number of results and execution time\r\n"
+                     "link newname linked_ch #link results to channel\r\n");
       break;
 
    case create_rmcios:
       if (num_params < 1)
          break;
       // Allocate new data:
-      this = (struct nido_data *) malloc (sizeof (struct nido_data));
+      this = (struct nifft_data *) malloc (sizeof (struct nifft_data));
+      if (this == NULL)
+         break;
 
       // Set default values:
-      this->task = 0;
-      this->value = 0;
+      this->input = NULL;
+      this->plan = NULL;
+      this->overlap = 0;
+      this->averages = 8;
+      this->segment = NULL;
+      this->fill = 0;
+      this->re = NULL;
+      this->im = NULL;
+      this->power = NULL;
+      this->psd = NULL;
+      this->segments = 0;
+      this->rate = 0;
+      this->bands = 0;
+      this->results_seq = 0;
+      this->num_results = 0;
+      this->spectra = 0;
+      this->exec_time = 0;
 
       // Create the channel
-      create_channel_param (context, paramtype, param, 0,
-                            (class_rmcios) nido_func, this);
+      this->id = create_channel_param (context, paramtype, param, 0,
+                                       (class_rmcios) nifft_func, this);
+      ni_register_resource (this, this->id, nifft_close, NULL);
       break;
 
    case setup_rmcios:
       if (this == NULL)
          break;
-      if (num_params < 3)
+      if (ni_is_command (context, paramtype, param, num_params, "close"))
+      {
+         nifft_close (this);
          break;
-
-      // Get the NI device for given channel:
-      struct ni_device_data *device =
-         get_ni_device_for_channel (param_to_int
-                                    (context, paramtype, param, 0));
-      if (device == NULL)
+      }
+      if (ni_is_command (context, paramtype, param, num_params, "peak")
+          || ni_is_command (context, paramtype, param, num_params, "bands"))
       {
-         printf ("No NI device channel: %s\r\n",
-                 param_to_string (context, paramtype, param, 1, 0, NULL));
+         struct ni_device_data *device = NULL;
+         int b, bands = 0;
+         if (num_params >= 3 
+             && ni_is_command (context, paramtype, param, num_params, 
+                               "bands"))
+            bands = num_params - 2;
+         if (bands > NIFFT_MAX_BANDS)
+            bands = NIFFT_MAX_BANDS;
+         if (this->input != NULL)
+            device = this->input->device;
+         if (device != NULL)
+            ni_lock_take (&device->lock);
+         for (b = 0; b <= bands && bands > 0; b++)
+            this->edges[b] = param_to_float (context, paramtype, param, b + 1);
+         this->bands = bands;
+         ni_seq_write_begin (&this->results_seq);
+         this->num_results = 0;
+         ni_seq_write_end (&this->results_seq);
+         if (device != NULL)
+            ni_lock_give (&device->lock);
          break;
       }
-      else
+      if (num_params < 2)
+         break;
       {
-         // Build physical channel string:
-         char port_str[30];
-         char line_str[30];
-         param_to_string (context, paramtype, param, 1,
-                          sizeof (port_str), port_str);
-         param_to_string (context, paramtype, param, 2,
-                          sizeof (line_str), line_str);
-
-         char physicalChannel[strlen (device->name) +
-                              strlen (port_str) + strlen (line_str) + 4];
-         strcpy (physicalChannel, device->name);
-         strcat (physicalChannel, "/");
-         strcat (physicalChannel, port_str);
-         strcat (physicalChannel, "/");
-         strcat (physicalChannel, line_str);
+         int input_id = param_to_int (context, paramtype, param, 0);
+         int size = param_to_int (context, paramtype, param, 1);
+         struct niai_data *input = ni_find_resource (input_id, niai_close);
+         int overlap = size / 2;
+         int averages = 8;
 
-         if (this->task != 0)
-         {  
-            DAQmxErrChk (DAQmxStopTask (this->task));   
-            DAQmxErrChk (DAQmxClearTask (this->task));  
+         if (input == NULL)
+         {
+            printf ("No niai channel for FFT input\r\n");
+            break;
          }
+         if (size < 8 || size > 65536 || (size & (size - 1)) != 0)
+         {
+            printf ("FFT segment must be power of two 8..65536\r\n");
+            break;
+         }
+         if (num_params >= 3)
+            overlap = param_to_int (context, paramtype, param, 2);
+         if (num_params >= 4)
+            averages = param_to_int (context, paramtype, param, 3);
+         if (overlap < 0 || overlap >= size)
+            overlap = size / 2;
+         if (averages < 1)
+            averages = 1;
 
-         DAQmxErrChk (DAQmxCreateTask ("", &this->task));
-         DAQmxErrChk (DAQmxCreateDOChan (this->task,
-                                         physicalChannel,
-                                         "", DAQmx_Val_ChanPerLine));
-         DAQmxErrChk (DAQmxStartTask (this->task));
-
+         nifft_close (this);
+         this->plan = ni_fft_plan_get (size);
+         this->segment = (float64 *) malloc (sizeof (float64) * size);
+         this->re = (float64 *) malloc (sizeof (float64) * size / 2);
+         this->im = (float64 *) malloc (sizeof (float64) * size / 2);
+         this->power = (float64 *) malloc (sizeof (float64) * (size/2 + 1));
+         this->psd = (float64 *) malloc (sizeof (float64) * (size / 2 + 1));
+         if (this->plan == NULL || this->segment == NULL || this->re == NULL
+             || this->im == NULL || this->power == NULL || this->psd == NULL)
+         {
+            printf ("Could not allocate FFT buffers\r\n");
+            nifft_close (this);
+            break;
+         }
+         this->overlap = overlap;
+         this->averages = averages;
+         this->fill = 0;
+         this->segments = 0;
+         this->rate = 0;
+         this->num_results = 0;
+         this->input = input;
+         if (input->device != NULL)
+            ni_lock_take (&input->device->lock);
+         ni_hook_add (&input->hooks, nifft_block, this);
+         if (input->device != NULL)
+            ni_lock_give (&input->device->lock);
       }
       break;
 
-   case write_rmcios:
-      if (this == NULL)
-         break;
-      if (num_params < 1)
-         break;
-      this->value = param_to_int (context, paramtype, param, 0);
-      DAQmxErrChk (DAQmxWriteDigitalLines
-                   (this->task, 1, 1, 10.0, DAQmx_Val_GroupByChannel,
-                    &this->value, NULL, NULL));
-      break;
-
    case read_rmcios:
       if (this == NULL)
          break;
-      return_int (context, returnv, this->value);
+      {
+         float results[NIFFT_MAX_BANDS];
+         int i, num_results;
+         uInt64 spectra;
+         uInt32 seq;
+
+         // Results are published by the acquisition thread of the device
+         do
+         {
+            seq = ni_seq_read_begin (&this->results_seq);
+            num_results = this->num_results;
+            memcpy (results, this->results, sizeof (float) * num_results);
+            spectra = this->spectra;
+         }
+         while (ni_seq_retry (&this->results_seq, seq));
+
+         if (ni_is_command (context, paramtype, param, num_params, "stats"))
+         {
+            return_string (context, returnv, "spectra ");
+            ni_return_u64 (context, returnv, spectra);
+            return_string (context, returnv, " exec_us ");
+            return_float (context, returnv, 
+                          ni_load_f64 (&this->exec_time) * 1e6);
+            break;
+         }
+         for (i = 0; i < num_results; i++)
+         {
+            return_float (context, returnv, results[i]);
+            return_string (context, returnv, " ");
+         }
+      }
       break;
    }
 }
@@ -903,11 +4110,59 @@ void init_nidaq_channels (const struct context_rmcios *context)
    printf ("NIDAQ module\r\n[" VERSION_STR "] \r\n");
 
    create_channel_str (context, "nidev", (class_rmcios) ni_device_func, NULL); 
+   create_channel_str (context, "nigroup", (class_rmcios) nigroup_func, NULL);
    create_channel_str (context, "niai", (class_rmcios) nidaq_ai_func, NULL); 
    create_channel_str (context, "niao", (class_rmcios) nidaq_ao_func, NULL);  
    create_channel_str (context, "nido", (class_rmcios) nido_func, NULL);
    create_channel_str (context, "nipwm", (class_rmcios) nipwm_func, NULL);
    create_channel_str (context, "nicounter", (class_rmcios)nicounter_func,NULL); 
+   create_channel_str (context, "nipid", (class_rmcios) nipid_func, NULL);
+   create_channel_str (context, "nifft", (class_rmcios) nifft_func, NULL);
+}
+
+// Stop and clear all driver tasks and free all channel data of the module.
+// Channels of the module must not be called after this.
+void deinit_nidaq_channels (void)
+{
+   struct ni_resource *resource;
+
+   ni_watchdog_shutdown ();
+
+   // Device workers are stopped before closing, without device locks held
+   for (resource = first_ni_resource; resource != NULL; 
+        resource = resource->next)
+   {
+      if (resource->close == ni_device_close)
+         ni_worker_stop ((struct ni_device_data *) resource->data);
+   }
+
+   // Close everything first. Channels refer to each other while closing.
+   // Devices go first so closing their analog inputs does not rebuild
+   // device tasks.
+   for (resource = first_ni_resource; resource != NULL; 
+        resource = resource->next)
+   {
+      if (resource->close == ni_device_close)
+         resource->close (resource->data);
+   }
+   for (resource = first_ni_resource; resource != NULL; 
+        resource = resource->next)
+   {
+      if (resource->close != ni_device_close)
+         resource->close (resource->data);
+   }
+
+   while (first_ni_resource != NULL)
+   {
+      resource = first_ni_resource;
+      first_ni_resource = resource->next;
+      if (resource->lock != NULL)
+         ni_lock_free (resource->lock);
+      free (resource->data);
+      free (resource);
+   }
+   first_ni_device = NULL;
+   ni_fft_plans_free ();
 }
 
 #ifdef INDEPENDENT_CHANNEL_MODULE
@@ -916,4 +4171,10 @@ void API_ENTRY_FUNC init_channels (const struct context_rmcios *context)
 {
    init_nidaq_channels (context);
 }
+
+// function for unloading the module
+void API_ENTRY_FUNC deinit_channels (void)
+{
+   deinit_nidaq_channels ();
+}
 #endif
@@ -0,0 +1,295 @@
+/*
+RMCIOS - Reactive Multipurpose Control Input Output System
+Copyright (c) 2018 Frans Korhonen
+
+RMIOS was originally developed at Institute for Atmospheric
+and Earth System Research / Physics, Faculty of Science,
+University of Helsinki, Finland
+
+This file is extension to RMCIOS. This notice was encoded using utf-8.
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * Shared memory ring of NI device acquisition blocks.
+ *
+ * Written by nidev channels set up with "setup dev shm name". Other local
+ * processes include this header to map and read the ring without copies
+ * through RMCIOS channels.
+ *
+ * Single writer. Every slot is protected by a sequence counter that is odd
+ * while the slot is being written. Readers take the counter before and
+ * after reading and retry when it changed or was odd. A slot that stays odd
+ * means the writer stopped in the middle of a write.
+ *
+ * The writer recreates the ring under the same name when channels or
+ * samples of the device change, and clears magic of the old ring. Readers
+ * that see magic cleared map the name again.
+ *
+ * Memory layout:
+ *   struct ni_shm_header
+ *   slots * slot_size bytes. Each slot:
+ *      struct ni_shm_slot
+ *      double mean[channels]
+ *      double min[channels]
+ *      double max[channels]
+ *      double data[channels][samples]   (grouped by channel)
+ * Values are in calibrated units of the device channels. Blocks coalesced
+ * by the overrun policy are longer than the ring samples. Their slots keep
+ * the latest samples, while mean, min and max cover block_samples.
+ */
+
+#ifndef RMCIOS_NI_DAQMX_SHM_H
+#define RMCIOS_NI_DAQMX_SHM_H
+
+#include <inttypes.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define NI_SHM_MAGIC   0x4e495348 // "NISH"
+#define NI_SHM_VERSION 1
+
+// Times a reader checks a slot that is being written before giving up.
+// Far longer than writing any block takes.
+#define NI_SHM_SPIN_LIMIT (1 << 26)
+
+struct ni_shm_header
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t slots;         // number of blocks in the ring
+   uint32_t channels;      // channels in every block
+   uint32_t samples;       // maximum samples per channel in a block
+   uint32_t slot_size;     // bytes from one slot to next
+   uint64_t head;          // number of blocks written. Latest=(head-1)%slots
+   uint8_t reserved[32];   // pad to 64 bytes
+};
+
+struct ni_shm_slot
+{
+   uint32_t seq;           // odd while slot is written
+   uint32_t channels;      // channels in this block
+   uint32_t samples;       // samples per channel in data of this block
+   uint32_t block_samples; // samples per channel reduced to mean, min, max
+   uint64_t block;         // block number of the device
+   double rate;            // sample rate
+   double time;            // writer monotonic time of the block in seconds
+   double pad[3];          // pad to 64 bytes
+};
+
+// Mapped shared memory
+struct ni_shm_map
+{
+   struct ni_shm_header *header;
+   size_t size;
+#ifdef _WIN32
+   HANDLE mapping;
+#endif
+};
+
+static inline size_t ni_shm_slot_size (uint32_t channels, uint32_t samples)
+{
+   return sizeof (struct ni_shm_slot)
+          + sizeof (double) * channels * (3 + (size_t) samples);
+}
+
+static inline struct ni_shm_slot *ni_shm_get_slot (struct ni_shm_header *h,
+                                                   uint64_t block)
+{
+   return (struct ni_shm_slot *) ((uint8_t *) h + sizeof (*h)
+                                  + (block % h->slots) * h->slot_size);
+}
+
+static inline double *ni_shm_slot_mean (struct ni_shm_header *h,
+                                        struct ni_shm_slot *slot)
+{
+   (void) h; // means start every slot. Same arguments as other accessors.
+   return (double *) (slot + 1);
+}
+
+static inline double *ni_shm_slot_min (struct ni_shm_header *h,
+                                       struct ni_shm_slot *slot)
+{
+   return ni_shm_slot_mean (h, slot) + h->channels;
+}
+
+static inline double *ni_shm_slot_max (struct ni_shm_header *h,
+                                       struct ni_shm_slot *slot)
+{
+   return ni_shm_slot_mean (h, slot) + 2 * h->channels;
+}
+
+static inline double *ni_shm_slot_data (struct ni_shm_header *h,
+                                        struct ni_shm_slot *slot)
+{
+   return ni_shm_slot_mean (h, slot) + 3 * h->channels;
+}
+
+static inline void ni_shm_close (struct ni_shm_map *map)
+{
+   if (map->header == NULL)
+      return;
+#ifdef _WIN32
+   UnmapViewOfFile (map->header);
+   CloseHandle (map->mapping);
+#else
+   munmap (map->header, map->size);
+#endif
+   map->header = NULL;
+}
+
+// Map named shared memory. Writer creates it with given size.
+// Readers pass size 0 to map the existing ring.
+// Returns 0 on success.
+static inline int ni_shm_open (struct ni_shm_map *map, const char *name,
+                               size_t size)
+{
+   int create = size > 0;
+   map->header = NULL;
+   map->size = 0;
+#ifdef _WIN32
+   if (create)
+      map->mapping = CreateFileMappingA (INVALID_HANDLE_VALUE, NULL,
+                                         PAGE_READWRITE,
+                                         (DWORD) ((uint64_t) size >> 32),
+                                         (DWORD) size, name);
+   else
+      map->mapping = OpenFileMappingA (FILE_MAP_READ, FALSE, name);
+   if (map->mapping == NULL)
+      return -1;
+   map->header = (struct ni_shm_header *)
+      MapViewOfFile (map->mapping, create ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ,
+                     0, 0, size);
+   if (map->header == NULL)
+   {
+      CloseHandle (map->mapping);
+      return -1;
+   }
+   if (!create)
+   {
+      MEMORY_BASIC_INFORMATION info;
+      VirtualQuery (map->header, &info, sizeof (info));
+      size = info.RegionSize;
+   }
+#else
+   // POSIX shared memory object names start with slash
+   char path[256] = "/";
+   strncat (path, name[0] == '/' ? name + 1 : name, sizeof (path) - 2);
+   int fd = shm_open (path, create ? O_CREAT | O_RDWR : O_RDONLY, 0644);
+   if (fd < 0)
+      return -1;
+   if (create && ftruncate (fd, size) != 0)
+   {
+      close (fd);
+      return -1;
+   }
+   if (!create)
+   {
+      size = lseek (fd, 0, SEEK_END);
+   }
+   void *base = mmap (NULL, size, create ? PROT_READ | PROT_WRITE : PROT_READ,
+                      MAP_SHARED, fd, 0);
+   close (fd);
+   if (base == MAP_FAILED)
+      return -1;
+   map->header = (struct ni_shm_header *) base;
+#endif
+   map->size = size;
+
+   if (!create && (size < sizeof (struct ni_shm_header)
+                   || map->header->magic != NI_SHM_MAGIC
+                   || map->header->version != NI_SHM_VERSION))
+   {
+      ni_shm_close (map);
+      return -1;
+   }
+   return 0;
+}
+
+// Remove the name of the shared memory. Mapped views stay valid.
+static inline void ni_shm_unlink (const char *name)
+{
+#ifndef _WIN32
+   char path[256] = "/";
+   strncat (path, name[0] == '/' ? name + 1 : name, sizeof (path) - 2);
+   shm_unlink (path);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////
+// Reader
+/////////////////////////////////////////////////////////////////////
+
+// Number of blocks written so far. Latest readable block is head-1.
+static inline uint64_t ni_shm_head (const struct ni_shm_map *map)
+{
+   return __atomic_load_n (&map->header->head, __ATOMIC_ACQUIRE);
+}
+
+// Start zero copy read of block. Stores sequence for ni_shm_read_end.
+// The block is only valid while it is newer than head - slots.
+// Returns 0, or -1 if the slot stays in write: the writer has stopped.
+static inline int ni_shm_read_begin (struct ni_shm_slot *slot, uint32_t *seq)
+{
+   long spins;
+   for (spins = 0; spins < NI_SHM_SPIN_LIMIT; spins++)
+   {
+      *seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+      if ((*seq & 1) == 0)
+         return 0;
+   }
+   return -1;
+}
+
+// Returns 1 if the data read since ni_shm_read_begin is consistent.
+static inline int ni_shm_read_end (struct ni_shm_slot *slot, uint32_t seq)
+{
+   __atomic_thread_fence (__ATOMIC_ACQUIRE);
+   return __atomic_load_n (&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+// Returns 1 while the writer keeps the ring. 0 when the ring was closed or
+// recreated with another layout and must be mapped again.
+static inline int ni_shm_valid (const struct ni_shm_map *map)
+{
+   return __atomic_load_n (&map->header->magic, __ATOMIC_ACQUIRE)
+          == NI_SHM_MAGIC;
+}
+
+// Copy latest channel means into values. Returns block number, -1 if
+// there are no blocks yet, or -2 if the ring must be mapped again or the
+// writer stopped in the middle of a block.
+static inline int64_t ni_shm_read_means (const struct ni_shm_map *map,
+                                         double *values, uint32_t channels)
+{
+   struct ni_shm_header *h = map->header;
+   for (;;)
+   {
+      uint32_t seq;
+      uint64_t head = ni_shm_head (map);
+      if (!ni_shm_valid (map))
+         return -2;
+      if (head == 0)
+         return -1;
+      struct ni_shm_slot *slot = ni_shm_get_slot (h, head - 1);
+      if (ni_shm_read_begin (slot, &seq) != 0)
+         return -2;
+      uint64_t block = slot->block;
+      if (channels > slot->channels)
+         channels = slot->channels;
+      memcpy (values, ni_shm_slot_mean (h, slot), sizeof (double) * channels);
+      if (ni_shm_read_end (slot, seq))
+         return block;
+   }
+}
+
+#endif
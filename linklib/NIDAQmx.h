@@ -28,6 +28,9 @@
 #define DAQmx_Val_CountDown          10124 
 #define DAQmx_Val_ExtControlled      10326 
 #define DAQmx_Val_ChanPerLine        0
+#define DAQmx_Val_Acquired_Into_Buffer 1
+
+#define DAQmxErrorSamplesNoLongerAvailable (-200279)
 
 #define DAQmxFailed(error)           ((error)<0)
 
@@ -43,12 +46,17 @@ typedef int64_t int64;
 typedef uint64_t uInt64;
 typedef uint32_t bool32;
 
+typedef int32_t (*DAQmxEveryNSamplesEventCallbackPtr)(void *, int32_t, uint32_t, void *);
+
 int32_t __stdcall DAQmxCreateTask(const char *, void *);
 int32_t __stdcall DAQmxStartTask(void *);
 int32_t __stdcall DAQmxStopTask(void *);
 int32_t __stdcall DAQmxReadAnalogF64(void *, int32_t, double, uint32_t, double *, uint32_t, int32_t *, uint32_t *);
 int32_t __stdcall DAQmxCreateAIVoltageChan(void *, const char *, const char *, int32_t, double, double, int32_t, const char *);
 int32_t __stdcall DAQmxCfgSampClkTiming(void *, const char *, double, int32_t, int32_t, uint64_t);
+int32_t __stdcall DAQmxGetSampClkRate(void *, double *);
+int32_t __stdcall DAQmxGetReadAvailSampPerChan(void *, uint32_t *);
+int32_t __stdcall DAQmxRegisterEveryNSamplesEvent(void *, int32_t, uint32_t, uint32_t, DAQmxEveryNSamplesEventCallbackPtr, void *);
 int32_t __stdcall DAQmxGetExtendedErrorInfo(char *, uint32_t);
 int32_t __stdcall DAQmxClearTask(void *);
 int32_t __stdcall DAQmxCreateAOVoltageChan(void *, const char *, const char *, double, double, int32_t, const char *);
@@ -0,0 +1,238 @@
+/*
+ * Threaded checks of values read without locks and of counter read and
+ * reset. Driver calls are stubbed, so no NI hardware is needed.
+ *
+ * Build and run from the repository root:
+ * gcc -std=gnu99 -D__stdcall= -Itests/stub -Ilinklib \
+ *     tests/RMCIOS-NI-DAQmx-concurrency-test.c tests/stub/NIDAQmx-stub.c \
+ *     -lpthread -lrt -lm -o ni-concurrency-test && ./ni-concurrency-test
+ */
+
+#include "../RMCIOS-NI-DAQmx-module.c"
+
+#define TEST_CHANNELS 64
+#define TEST_SAMPLES 16
+#define TEST_BLOCKS 200000
+#define TEST_READERS 2
+#define TEST_COUNTER_CALLS 200000
+
+// Values returned by one channel call
+struct combo_rmcios
+{
+   float values[NI_MAX_CHANNELS];
+   int num_values;
+   int int_value;
+};
+
+// RMCIOS interface stubs
+const char *param_to_string (const struct context_rmcios *context,
+                             enum type_rmcios paramtype,
+                             const union param_rmcios param, int index,
+                             int maxlen, char *buffer)
+{
+   if (buffer != NULL && maxlen > 0)
+      buffer[0] = 0;
+   return "";
+}
+
+int param_to_int (const struct context_rmcios *context,
+                  enum type_rmcios paramtype,
+                  const union param_rmcios param, int index)
+{
+   return 0;
+}
+
+float param_to_float (const struct context_rmcios *context,
+                      enum type_rmcios paramtype,
+                      const union param_rmcios param, int index)
+{
+   return 0;
+}
+
+void return_string (const struct context_rmcios *context,
+                    struct combo_rmcios *returnv, const char *str)
+{
+}
+
+void return_float (const struct context_rmcios *context,
+                   struct combo_rmcios *returnv, float value)
+{
+   if (returnv != NULL && returnv->num_values < NI_MAX_CHANNELS)
+      returnv->values[returnv->num_values++] = value;
+}
+
+void return_int (const struct context_rmcios *context,
+                 struct combo_rmcios *returnv, int value)
+{
+   if (returnv != NULL)
+      returnv->int_value = value;
+}
+
+void run_channel (const struct context_rmcios *context, int id,
+                  enum function_rmcios function, enum type_rmcios paramtype,
+                  struct combo_rmcios *returnv, int num_params,
+                  const union param_rmcios param)
+{
+}
+
+int linked_channels (const struct context_rmcios *context, int id)
+{
+   return 0;
+}
+
+void write_f (const struct context_rmcios *context, int id, float value)
+{
+}
+
+int create_channel_param (const struct context_rmcios *context,
+                          enum type_rmcios paramtype,
+                          const union param_rmcios param, int index,
+                          class_rmcios func, void *data)
+{
+   return 0;
+}
+
+int create_channel_str (const struct context_rmcios *context,
+                        const char *name, class_rmcios func, void *data)
+{
+   return 0;
+}
+
+void link_channel (const struct context_rmcios *context, int from, int to)
+{
+}
+
+/////////////////////////////////////////////////////////////////////
+// nidev values published to readers without locks
+/////////////////////////////////////////////////////////////////////
+static struct ni_device_data test_device;
+static int test_done = 0;
+
+// Acquisition thread. Every block has the same value on all channels.
+void *test_device_writer (void *arg)
+{
+   static float64 data[TEST_CHANNELS * TEST_SAMPLES];
+   int block, i;
+   for (block = 1; block <= TEST_BLOCKS; block++)
+   {
+      for (i = 0; i < TEST_CHANNELS * TEST_SAMPLES; i++)
+         data[i] = block;
+      ni_lock_take (&test_device.lock);
+      ni_device_process (&test_device, NULL, data, TEST_SAMPLES);
+      ni_lock_give (&test_device.lock);
+   }
+   __atomic_store_n (&test_done, 1, __ATOMIC_RELEASE);
+   return NULL;
+}
+
+// Reader thread. Returns number of reads with values of several blocks.
+void *test_device_reader (void *arg)
+{
+   long torn = 0;
+   long *result = (long *) arg;
+   float last = 0;
+   while (!__atomic_load_n (&test_done, __ATOMIC_ACQUIRE))
+   {
+      struct combo_rmcios returnv;
+      int i;
+      returnv.num_values = 0;
+      ni_device_func (&test_device, NULL, 0, read_rmcios, int_rmcios,
+                      &returnv, 0, (const union param_rmcios) NULL);
+      if (returnv.num_values != TEST_CHANNELS)
+      {
+         torn++;
+         continue;
+      }
+      for (i = 1; i < returnv.num_values; i++)
+      {
+         if (returnv.values[i] != returnv.values[0])
+            break;
+      }
+      if (i < returnv.num_values || returnv.values[0] < last)
+         torn++;
+      last = returnv.values[0];
+   }
+   *result = torn;
+   return NULL;
+}
+
+int test_device_values (void)
+{
+   pthread_t writer;
+   pthread_t readers[TEST_READERS];
+   long torn[TEST_READERS];
+   long total = 0;
+   int ch, i;
+
+   memset (&test_device, 0, sizeof (test_device));
+   ni_lock_init (&test_device.lock);
+   test_device.channels = TEST_CHANNELS;
+   for (ch = 0; ch < TEST_CHANNELS; ch++)
+      test_device.gain[ch] = 1;
+
+   for (i = 0; i < TEST_READERS; i++)
+      pthread_create (&readers[i], NULL, test_device_reader, &torn[i]);
+   pthread_create (&writer, NULL, test_device_writer, NULL);
+   pthread_join (writer, NULL);
+   for (i = 0; i < TEST_READERS; i++)
+   {
+      pthread_join (readers[i], NULL);
+      total += torn[i];
+   }
+   ni_lock_free (&test_device.lock);
+
+   printf ("nidev values: %d blocks, %ld torn reads\n", TEST_BLOCKS, total);
+   return total == 0 && test_device.blocks == TEST_BLOCKS;
+}
+
+/////////////////////////////////////////////////////////////////////
+// nicounter read and reset from several threads
+/////////////////////////////////////////////////////////////////////
+static struct nicounter_data test_counter;
+
+// Returns number of read and resets that did not report exactly the one
+// count the stub counter advanced during the call.
+void *test_counter_caller (void *arg)
+{
+   long *wrong = (long *) arg;
+   int i;
+   *wrong = 0;
+   for (i = 0; i < TEST_COUNTER_CALLS; i++)
+   {
+      struct combo_rmcios returnv;
+      nicounter_func (&test_counter, NULL, 0, write_rmcios, int_rmcios,
+                      &returnv, 0, (const union param_rmcios) NULL);
+      if (returnv.int_value != 1)
+         (*wrong)++;
+   }
+   return NULL;
+}
+
+int test_counter_reset (void)
+{
+   pthread_t callers[2];
+   long wrong[2];
+
+   memset (&test_counter, 0, sizeof (test_counter));
+   ni_lock_init (&test_counter.lock);
+   test_counter.task = (TaskHandle) 1;
+
+   pthread_create (&callers[0], NULL, test_counter_caller, &wrong[0]);
+   pthread_create (&callers[1], NULL, test_counter_caller, &wrong[1]);
+   pthread_join (callers[0], NULL);
+   pthread_join (callers[1], NULL);
+   ni_lock_free (&test_counter.lock);
+
+   printf ("nicounter reset: %d calls, %ld lost or repeated counts\n",
+           2 * TEST_COUNTER_CALLS, wrong[0] + wrong[1]);
+   return wrong[0] + wrong[1] == 0;
+}
+
+int main (void)
+{
+   int passed = 1;
+   passed &= test_device_values ();
+   passed &= test_counter_reset ();
+   printf (passed ? "PASS\n" : "FAIL\n");
+   return passed ? 0 : 1;
+}
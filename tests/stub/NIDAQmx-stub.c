@@ -0,0 +1,35 @@
+/*
+ * NI-DAQmx stubs for tests. Driver calls succeed without hardware.
+ * Counter reads return a count that advances by one on every read.
+ */
+#include <stdint.h>
+
+static uint32_t stub_counts = 0;
+
+int32_t DAQmxReadCounterScalarU32 (void *task, double timeout,
+                                   uint32_t *value, uint32_t *reserved)
+{
+   *value = __atomic_add_fetch (&stub_counts, 1, __ATOMIC_SEQ_CST);
+   return 0;
+}
+
+int32_t DAQmxCfgImplicitTiming () { return 0; }
+int32_t DAQmxCfgSampClkTiming () { return 0; }
+int32_t DAQmxClearTask () { return 0; }
+int32_t DAQmxCreateAIVoltageChan () { return 0; }
+int32_t DAQmxCreateAOVoltageChan () { return 0; }
+int32_t DAQmxCreateCICountEdgesChan () { return 0; }
+int32_t DAQmxCreateCOPulseChanFreq () { return 0; }
+int32_t DAQmxCreateDOChan () { return 0; }
+int32_t DAQmxCreateTask () { return 0; }
+int32_t DAQmxGetExtendedErrorInfo () { return 0; }
+int32_t DAQmxGetReadAvailSampPerChan () { return 0; }
+int32_t DAQmxGetSampClkRate () { return 0; }
+int32_t DAQmxReadAnalogF64 () { return 0; }
+int32_t DAQmxRegisterEveryNSamplesEvent () { return 0; }
+int32_t DAQmxSetCICountEdgesTerm () { return 0; }
+int32_t DAQmxStartTask () { return 0; }
+int32_t DAQmxStopTask () { return 0; }
+int32_t DAQmxWriteAnalogScalarF64 () { return 0; }
+int32_t DAQmxWriteCtrFreq () { return 0; }
+int32_t DAQmxWriteDigitalLines () { return 0; }
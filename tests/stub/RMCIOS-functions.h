@@ -0,0 +1,61 @@
+/*
+ * Minimal RMCIOS interface for building the module in tests without the
+ * RMCIOS-interface submodule. Declares only what the module uses.
+ */
+#ifndef RMCIOS_FUNCTIONS_STUB_H
+#define RMCIOS_FUNCTIONS_STUB_H
+
+#define VERSION_STR "test"
+#define API_ENTRY_FUNC
+
+struct context_rmcios;
+struct combo_rmcios;
+
+enum function_rmcios
+{
+   help_rmcios, setup_rmcios, write_rmcios, read_rmcios, create_rmcios
+};
+
+enum type_rmcios
+{
+   int_rmcios, float_rmcios, buffer_rmcios
+};
+
+union param_rmcios
+{
+   float *f;
+   const float *fv;
+   const int *iv;
+   const char **cv;
+   void *p;
+};
+
+typedef void (*class_rmcios) (void *, const struct context_rmcios *, int,
+                              enum function_rmcios, enum type_rmcios,
+                              struct combo_rmcios *, int,
+                              const union param_rmcios);
+
+const char *param_to_string (const struct context_rmcios *, enum type_rmcios,
+                             const union param_rmcios, int, int, char *);
+int param_to_int (const struct context_rmcios *, enum type_rmcios,
+                  const union param_rmcios, int);
+float param_to_float (const struct context_rmcios *, enum type_rmcios,
+                      const union param_rmcios, int);
+void return_string (const struct context_rmcios *, struct combo_rmcios *,
+                    const char *);
+void return_float (const struct context_rmcios *, struct combo_rmcios *,
+                   float);
+void return_int (const struct context_rmcios *, struct combo_rmcios *, int);
+void run_channel (const struct context_rmcios *, int, enum function_rmcios,
+                  enum type_rmcios, struct combo_rmcios *, int,
+                  const union param_rmcios);
+int linked_channels (const struct context_rmcios *, int);
+void write_f (const struct context_rmcios *, int, float);
+int create_channel_param (const struct context_rmcios *, enum type_rmcios,
+                          const union param_rmcios, int, class_rmcios,
+                          void *);
+int create_channel_str (const struct context_rmcios *, const char *,
+                        class_rmcios, void *);
+void link_channel (const struct context_rmcios *, int, int);
+
+#endif